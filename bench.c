@@ -0,0 +1,532 @@
+// Benchmarks of the shell's hot paths, built with the shell itself
+#define SHELL_NO_MAIN
+#include "shell.c"
+
+#define BENCH_LONG_TOKENS 65536
+#define BENCH_CHAIN_LENGTH 16
+#define BENCH_MAX_FANOUT 256
+#define BENCH_HISTORY_LINES 200000
+#define BENCH_BIG_HEAP (256L << 20)
+#define BENCH_SCAN_LINE 256
+
+FILE *out;
+int json;
+int scale = 1;
+
+/**
+ * @fn result
+ * @param[in] bench
+ * @param[in] name Case of the benchmark
+ * @param[in] metric
+ * @param[in] value
+ * @param[in] unit
+ * @brief Print one measurement, as a table row or as a JSON line
+ */
+void result(const char *bench, const char *name, const char *metric,
+            double value, const char *unit) {
+  if (json) {
+    fprintf(out,
+            "{\"bench\":\"%s\",\"case\":\"%s\",\"metric\":\"%s\","
+            "\"value\":%.3f,\"unit\":\"%s\"}\n",
+            bench, name, metric, value, unit);
+  } else {
+    fprintf(out, "%-12s %-12s %-10s %14.3f %s\n", bench, name, metric, value,
+            unit);
+  }
+  fflush(out);
+}
+
+/**
+ * @fn compare_long
+ * @param[in] a
+ * @param[in] b
+ * @return order of the two longs, for qsort
+ */
+int compare_long(const void *a, const void *b) {
+  long x = *(const long *)a, y = *(const long *)b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * @fn latencies
+ * @param[in] bench
+ * @param[in] name
+ * @param[in] samples In nanoseconds (sorted here)
+ * @param[in] n
+ * @brief Print average, median and 99th percentile of the samples
+ */
+void latencies(const char *bench, const char *name, long *samples, int n) {
+  double total = 0;
+  int i;
+
+  qsort(samples, n, sizeof(long), compare_long);
+  for (i = 0; i < n; ++i) {
+    total += samples[i];
+  }
+  result(bench, name, "avg", total / n / 1e3, "us");
+  result(bench, name, "p50", samples[n / 2] / 1e3, "us");
+  result(bench, name, "p99", samples[n * 99 / 100] / 1e3, "us");
+}
+
+/**
+ * @fn line_tokens
+ * @param[in] line
+ * @return tokens of a fresh copy of line (valid until the next call)
+ */
+char **line_tokens(const char *line) {
+  size_t len = strlen(line);
+  char *copy;
+
+  arena_reset(&line_arena);
+  copy = (char *)arena_alloc(&line_arena, len + 1);
+  memcpy(copy, line, len + 1);
+  return tokenize(copy, &line_arena);
+}
+
+/**
+ * @fn repeat
+ * @param[in] word
+ * @param[in] sep
+ * @param[in] n
+ * @return n times word joined by sep (to be freed)
+ */
+char *repeat(const char *word, const char *sep, int n) {
+  size_t wlen = strlen(word), slen = strlen(sep);
+  char *line = (char *)malloc(n * (wlen + slen) + 1);
+  char *p = line;
+  int i;
+
+  for (i = 0; i < n; ++i) {
+    if (i > 0) {
+      memcpy(p, sep, slen);
+      p += slen;
+    }
+    memcpy(p, word, wlen);
+    p += wlen;
+  }
+  *p = '\0';
+  return line;
+}
+
+// Ways of marking the bytes scan() looks at, the CPU may lack some
+struct scanner {
+  const char *name;
+  void (*mark)(const char *s, size_t len, uint64_t *bits);
+} scanners[] = {
+    {"scalar", mark_scalar},
+#ifdef SCAN_X86
+    {"sse2", mark_sse2},
+    {"avx2", mark_avx2},
+#endif
+};
+
+/**
+ * @fn scanner_usable
+ * @param[in] k Index in scanners
+ * @return whether this CPU can run the scanner
+ */
+int scanner_usable(size_t k) {
+#ifdef SCAN_X86
+  if (scanners[k].mark == mark_avx2) {
+    return __builtin_cpu_supports("avx2");
+  }
+#endif
+  return 1;
+}
+
+/**
+ * @fn scan_with
+ * @param[in] mark
+ * @param[in] line
+ * @param[in] len
+ * @param[out] text Tokens as scan() writes them
+ * @param[out] views
+ * @return what scan() returns, marking special bytes with mark
+ */
+ssize_t scan_with(void (*mark)(const char *, size_t, uint64_t *),
+                  const char *line, size_t len, char *text,
+                  struct token *views) {
+  void (*saved)(const char *, size_t, uint64_t *) = scan_mark;
+  uint64_t bits[(BENCH_SCAN_LINE + 63) / 64];
+  ssize_t n;
+
+  scan_mark = mark;
+  n = scan(line, len, bits, text, views);
+  scan_mark = saved;
+  return n;
+}
+
+/**
+ * @fn bench_scan_check
+ * @return number of lines some scanner got wrong
+ * @brief Scan random lines (mostly made of the bytes that matter) with
+ *        every scanner and count those where the tokens differ from the
+ *        scalar ones
+ */
+int bench_scan_check(void) {
+  static const char alphabet[] = "ab  \t\n'\"\\&|xyz0123";
+  size_t len, max = BENCH_SCAN_LINE, i;
+  char *line = (char *)malloc(max), *expected = (char *)malloc(2 * max + 1);
+  char *text = (char *)malloc(2 * max + 1);
+  struct token *want = (struct token *)malloc(max * sizeof(struct token));
+  struct token *got = (struct token *)malloc(max * sizeof(struct token));
+  int iter, n = 20000 * scale, mismatches, total = 0;
+  size_t k;
+  ssize_t wanted, count, t;
+
+  srand(1);
+  for (k = 1; k < sizeof(scanners) / sizeof(scanners[0]); ++k) {
+    if (!scanner_usable(k)) {
+      continue;
+    }
+    mismatches = 0;
+    for (iter = 0; iter < n; ++iter) {
+      len = rand() % max;
+      for (i = 0; i < len; ++i) {
+        line[i] = rand() % 4 ? alphabet[rand() % (sizeof(alphabet) - 1)]
+                             : 'a' + rand() % 26;
+      }
+      wanted = scan_with(mark_scalar, line, len, expected, want);
+      count = scan_with(scanners[k].mark, line, len, text, got);
+      if (count != wanted) {
+        mismatches++;
+        continue;
+      }
+      for (t = 0; t < count; ++t) {
+        if (got[t].off != want[t].off || got[t].len != want[t].len ||
+            got[t].op != want[t].op ||
+            memcmp(text + got[t].off, expected + want[t].off, got[t].len)) {
+          mismatches++;
+          break;
+        }
+      }
+    }
+    if (mismatches > 0) {
+      fprintf(stderr, "Shell: %s scanner differs on %d lines\n",
+              scanners[k].name, mismatches);
+    }
+    result("scan", scanners[k].name, "mismatch", mismatches, "lines");
+    total += mismatches;
+  }
+  free(line);
+  free(expected);
+  free(text);
+  free(want);
+  free(got);
+  return total;
+}
+
+/**
+ * @fn bench_tokenize_line
+ * @param[in] name
+ * @param[in] line
+ * @param[in] iterations
+ * @brief Throughput of tokenize() on copies of line
+ */
+void bench_tokenize_line(const char *name, const char *line, int iterations) {
+  size_t len = strlen(line);
+  char *copy = (char *)malloc(len + 1);
+  long start, elapsed;
+  int i;
+
+  start = now_ns();
+  for (i = 0; i < iterations; ++i) {
+    memcpy(copy, line, len + 1);
+    arena_reset(&line_arena);
+    tokenize(copy, &line_arena);
+  }
+  elapsed = now_ns() - start;
+  free(copy);
+
+  result("tokenize", name, "line", (double)elapsed / iterations / 1e3, "us");
+  result("tokenize", name, "rate", len * (double)iterations / elapsed * 1e3,
+         "MB/s");
+}
+
+/**
+ * @fn bench_tokenize
+ * @brief tokenize() with each scanner on a typical short line, a very long
+ *        one and a long one made of quoted words
+ */
+void bench_tokenize(void) {
+  char *line = repeat("argument", " ", BENCH_LONG_TOKENS);
+  char *quoted = repeat("\"a quoted argument\"", " ", BENCH_LONG_TOKENS / 4);
+  void (*saved)(const char *, size_t, uint64_t *) = scan_mark;
+  char name[32];
+  size_t k;
+
+  for (k = 0; k < sizeof(scanners) / sizeof(scanners[0]); ++k) {
+    if (!scanner_usable(k)) {
+      continue;
+    }
+    scan_mark = scanners[k].mark;
+    snprintf(name, sizeof(name), "short %s", scanners[k].name);
+    bench_tokenize_line(
+        name, "ls -l /tmp && grep -v foo bar | wc -l &&& echo done\n",
+        200000 * scale);
+    snprintf(name, sizeof(name), "long %s", scanners[k].name);
+    bench_tokenize_line(name, line, 20 * scale);
+    snprintf(name, sizeof(name), "quote %s", scanners[k].name);
+    bench_tokenize_line(name, quoted, 20 * scale);
+  }
+  scan_mark = saved;
+  free(line);
+  free(quoted);
+}
+
+/**
+ * @fn bench_normal_engines
+ * @param[in] suffix Appended to the engine names in the results
+ * @brief Spawn-to-exit latency of normal() for /bin/true, with each engine
+ *        (the zygote refills its pool meanwhile)
+ */
+void bench_normal_engines(const char *suffix) {
+  int i, mode, n = 1000 * scale, saved = spawn_mode;
+  long *samples = (long *)malloc(n * sizeof(long));
+  char name[32];
+  struct chain c;
+
+  for (mode = 0; mode < 3; ++mode) {
+    spawn_mode = mode;
+    for (i = 0; i < n; ++i) {
+      char **tokens = line_tokens("/bin/true");
+      long start = now_ns();
+      memset(&c, 0, sizeof(c));
+      c.in_shell = 1;
+      c.group = &fg_group;
+      normal(tokens, NULL, &c, NULL);
+      while (c.pending > 0) {
+        wait_events(-1);
+      }
+      samples[i] = now_ns() - start;
+    }
+    snprintf(name, sizeof(name), "%s%s", spawn_names[mode], suffix);
+    latencies("normal", name, samples, n);
+  }
+  spawn_mode = saved;
+  free(samples);
+}
+
+/**
+ * @fn bench_normal
+ * @brief Launch latency of each engine, then again once the shell has a
+ *        large heap (which fork has to copy the page tables of)
+ */
+void bench_normal(void) {
+  char *heap = (char *)malloc(BENCH_BIG_HEAP);
+
+  bench_normal_engines("");
+  if (heap != NULL) {
+    memset(heap, 1, BENCH_BIG_HEAP);
+    bench_normal_engines(" 256M");
+    free(heap);
+  }
+}
+
+/**
+ * @fn bench_series
+ * @brief Throughput of "&&" chains of /bin/true through series()
+ */
+void bench_series(void) {
+  char *line = repeat("/bin/true", " && ", BENCH_CHAIN_LENGTH);
+  int i, n = 100 * scale;
+  long start, elapsed;
+
+  start = now_ns();
+  for (i = 0; i < n; ++i) {
+    series(line_tokens(line), NULL);
+  }
+  elapsed = now_ns() - start;
+  free(line);
+
+  result("series", "true x16", "command",
+         (double)elapsed / n / BENCH_CHAIN_LENGTH / 1e3, "us");
+  result("series", "true x16", "rate",
+         (double)n * BENCH_CHAIN_LENGTH / elapsed * 1e9, "cmd/s");
+}
+
+/**
+ * @fn bench_fanout
+ * @brief "&&&" lines of 1 to 256 /bin/true segments through work(), with
+ *        enough slots for all of them
+ */
+void bench_fanout(void) {
+  int i, n, reps, saved = max_jobs;
+  char name[16];
+  long start, elapsed;
+
+  max_jobs = BENCH_MAX_FANOUT;
+  for (n = 1; n <= BENCH_MAX_FANOUT; n *= 2) {
+    char *line = repeat("/bin/true", " &&& ", n);
+    reps = 1024 * scale / n;
+    if (reps < 4) {
+      reps = 4;
+    }
+
+    start = now_ns();
+    for (i = 0; i < reps; ++i) {
+      work(line_tokens(line));
+    }
+    elapsed = now_ns() - start;
+    free(line);
+
+    snprintf(name, sizeof(name), "%d", n);
+    result("fanout", name, "line", (double)elapsed / reps / 1e3, "us");
+    result("fanout", name, "segment", (double)elapsed / reps / n / 1e3, "us");
+  }
+  max_jobs = saved;
+}
+
+/**
+ * @fn bench_background
+ * @brief Cost of a background /bin/true, from launch until it is reaped,
+ *        while other background jobs keep running
+ */
+void bench_background(void) {
+  static const int live_jobs[] = {0, 16, 256};
+  int i, n = 500 * scale;
+  size_t j, b, live;
+  long *samples = (long *)malloc(n * sizeof(long));
+  char name[16];
+
+  for (j = 0; j < sizeof(live_jobs) / sizeof(live_jobs[0]); ++j) {
+    // Jobs that stay alive meanwhile
+    for (i = 0; i < live_jobs[j]; ++i) {
+      background(line_tokens("/bin/sleep 1000"), NULL, NULL);
+    }
+    live = procs.count;
+
+    for (i = 0; i < n; ++i) {
+      long start = now_ns();
+      background(line_tokens("/bin/true"), NULL, NULL);
+      while (procs.count > live) {
+        wait_events(-1);
+      }
+      samples[i] = now_ns() - start;
+    }
+    snprintf(name, sizeof(name), "live %zu", live);
+    latencies("background", name, samples, n);
+
+    // Kill the live jobs and wait for them to be reaped
+    for (b = 0; b < procs.nbuckets; b++) {
+      struct proc *p;
+      for (p = procs.buckets[b]; p != NULL; p = p->next) {
+        kill(p->pid, SIGKILL);
+      }
+    }
+    while (procs.count > 0) {
+      wait_events(-1);
+    }
+  }
+  free(samples);
+}
+
+/**
+ * @fn bench_history
+ * @brief Index build and latest-match lookups over a generated history log
+ */
+void bench_history(void) {
+  static const char *words[] = {"git", "make", "ls", "grep", "ssh", "gcc"};
+  char path[] = "/tmp/shell-bench-XXXXXX", pat[32];
+  int i, fd, n = BENCH_HISTORY_LINES * scale;
+  long start, elapsed;
+  FILE *log;
+
+  fd = mkstemp(path);
+  log = fd != -1 ? fdopen(fd, "w") : NULL;
+  if (log == NULL) {
+    return;
+  }
+  srand(1);
+  for (i = 0; i < n; ++i) {
+    fprintf(log, "%s arg%d arg%d\n", words[rand() % 6], rand() % 100000,
+            rand() % 100000);
+  }
+  fclose(log);
+  setenv("HISTFILE", path, 1);
+  history_open(0);
+  history_refresh();
+
+  start = now_ns();
+  history_index_prefix();
+  result("history", "prefix", "index", (now_ns() - start) / 1e6, "ms");
+  start = now_ns();
+  history_index_trigrams();
+  result("history", "substring", "index", (now_ns() - start) / 1e6, "ms");
+
+  start = now_ns();
+  for (i = 0; i < 1000; ++i) {
+    snprintf(pat, sizeof(pat), "%s arg%d", words[i % 6], i);
+    history_latest(pat, strlen(pat), 1);
+  }
+  elapsed = now_ns() - start;
+  result("history", "prefix", "lookup", elapsed / 1000 / 1e3, "us");
+  start = now_ns();
+  for (i = 0; i < 1000; ++i) {
+    snprintf(pat, sizeof(pat), "arg%d", 10000 + i);
+    history_latest(pat, strlen(pat), 0);
+  }
+  elapsed = now_ns() - start;
+  result("history", "substring", "lookup", elapsed / 1000 / 1e3, "us");
+
+  unlink(path);
+}
+
+int main(int argc, char *argv[]) {
+  int opt, devnull, check = 0;
+
+  while ((opt = getopt(argc, argv, "cJn:")) != -1) {
+    if (opt == 'c') {
+      check = 1;
+    } else if (opt == 'J') {
+      json = 1;
+    } else if (opt == 'n' && atoi(optarg) > 0) {
+      scale = atoi(optarg);
+    } else {
+      fprintf(stderr, "Usage: %s [-c] [-J] [-n scale]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  // Only the scanners, checked against each other as part of the build
+  if (check) {
+    out = stdout;
+    return bench_scan_check() > 0;
+  }
+
+  // Forked first, while this process is at its smallest
+  if (zygote_start() == -1) {
+    fprintf(stderr, "Shell: Can't start the zygote\n");
+    return 1;
+  }
+
+  // Results go to the real stdout, what the shell prints is dropped
+  out = fdopen(dup(STDOUT_FILENO), "w");
+  devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  if (out == NULL || devnull == -1) {
+    fprintf(stderr, "Shell: Can't set up output\n");
+    return 1;
+  }
+  dup2(devnull, STDOUT_FILENO);
+
+  max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  if (max_jobs < 1) {
+    max_jobs = 1;
+  }
+  events_init();
+
+  if (!json) {
+    fprintf(out, "%-12s %-12s %-10s %14s %s\n", "bench", "case", "metric",
+            "value", "unit");
+  }
+  if (bench_scan_check() > 0) {
+    return 1;
+  }
+  bench_tokenize();
+  bench_normal();
+  bench_series();
+  bench_fanout();
+  bench_background();
+  bench_history();
+  return 0;
+}
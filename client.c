@@ -0,0 +1,125 @@
+// Client of a shell in server mode (shell.o -S socket): runs command lines
+// there with this process's stdin, stdout and stderr
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/**
+ * @fn connect_shell
+ * @param[in] path Socket the shell listens on
+ * @return connected socket, -1 on error
+ * @brief Connect and hand the shell stdin, stdout and stderr (SCM_RIGHTS)
+ */
+int connect_shell(const char *path) {
+  int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+  char cbuf[CMSG_SPACE(sizeof(fds))], byte = 0;
+  struct iovec iov = {&byte, 1};
+  struct sockaddr_un addr;
+  struct msghdr msg;
+  struct cmsghdr *cm;
+  int fd;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    return -1;
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+  cm = CMSG_FIRSTHDR(&msg);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+  if (sendmsg(fd, &msg, 0) != 1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * @fn run_line
+ * @param[in] fd
+ * @param[in] line
+ * @param[in] verbose Print the shell's report to stderr
+ * @return exit status of the line, -1 if the shell went away
+ */
+int run_line(int fd, const char *line, int verbose) {
+  char reply[256], rest[256], *buf;
+  size_t len = 0, room;
+  ssize_t n;
+  int status;
+
+  if (write(fd, line, strlen(line)) == -1 || write(fd, "\n", 1) != 1) {
+    return -1;
+  }
+  // "status <n> real_us <n> ...", one line per command line. What doesn't
+  // fit in reply is read up to the newline and dropped
+  do {
+    buf = len < sizeof(reply) - 1 ? reply + len : rest;
+    room = buf == rest ? sizeof(rest) : sizeof(reply) - 1 - len;
+    n = read(fd, buf, room);
+    if (n <= 0) {
+      return -1;
+    }
+    if (buf != rest) {
+      len += n;
+    }
+  } while (buf[n - 1] != '\n');
+  reply[len] = '\0';
+  if (verbose) {
+    fputs(reply, stderr);
+    if (reply[len - 1] != '\n') {
+      fputs("\n", stderr);
+    }
+  }
+  if (sscanf(reply, "status %d", &status) != 1) {
+    return -1;
+  }
+  return status;
+}
+
+int main(int argc, char *argv[]) {
+  int i, opt, fd, verbose = 0, status = 0;
+  const char *path = NULL;
+
+  while ((opt = getopt(argc, argv, "S:v")) != -1) {
+    if (opt == 'S') {
+      path = optarg;
+    } else if (opt == 'v') {
+      verbose = 1;
+    } else {
+      path = NULL;
+      break;
+    }
+  }
+  if (path == NULL || optind == argc) {
+    fprintf(stderr, "Usage: %s -S socket [-v] line...\n", argv[0]);
+    return 2;
+  }
+
+  fd = connect_shell(path);
+  if (fd == -1) {
+    fprintf(stderr, "Shell: Can't connect to %s\n", path);
+    return 2;
+  }
+  for (i = optind; i < argc; ++i) {
+    status = run_line(fd, argv[i], verbose);
+    if (status == -1) {
+      fprintf(stderr, "Shell: Server went away\n");
+      return 2;
+    }
+  }
+  close(fd);
+  return status;
+}
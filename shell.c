@@ -1,363 +1,7377 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/ioprio.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <dirent.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
-#define MAX_INPUT_SIZE 1024
-#define MAX_TOKEN_SIZE 64
-#define MAX_NUM_TOKENS 64
-#define MAX_BG_PROCESS 64
-#define MAX_FG_PROCESS 64
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86
+#include <immintrin.h>
+#endif
 
-int background_proc[MAX_BG_PROCESS];
-int foreground_proc[MAX_FG_PROCESS];
+#define READ_BUFFER_SIZE (1 << 20)
+#define SPLICE_CHUNK (1 << 20)
+#define COPY_BUFFER_SIZE (1 << 16)
+#define ARENA_BLOCK_SIZE 4096
+#define PROC_BATCH 64
+#define HASH_BUCKETS 64
+#define BUILTIN_BUCKETS 64
+#define BUILTIN_PENDING -1
+#define BUILTIN_FORKS_STDIN 2
+#define MAX_EVENTS 64
+#define HISTORY_BATCH 1024
+#define HISTORY_TAIL 1024
+#define HISTORY_TRIGRAM_BITS 16
+#define DIR_BATCH (1 << 16)
+#define DIR_BUCKETS 256
+#define EDITOR_INPUT_SIZE 256
+#define EDITOR_MAX_SHOWN 200
+#define TOPOLOGY_MAX_NODES 64
+#define KILL_GRACE_MS 2000
+#define LINE_POLL_MS 10
+#define HIST_SUB_BITS 4
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+#define CLIENT_BUFFER_SIZE (1 << 16)
+#define ZYGOTE_POOL 4
+
+#define SPAWN_FORK 0
+#define SPAWN_POSIX 1
+#define SPAWN_ZYGOTE 2
+
+#define PLACE_NONE 0
+#define PLACE_RR 1
+#define PLACE_NUMA 2
+
+#define DAG_WAITING 0
+#define DAG_RUNNING 1
+#define DAG_DONE 2
+#define DAG_SKIPPED 3
+
+#define OUTPUT_DIRECT 0
+#define OUTPUT_GROUP 1
+#define OUTPUT_PREFIX 2
+
+// Trace points, compiled in with -DSHELL_TRACE and enabled by level
+#define TRACE_PROC 1
+#define TRACE_CMD 2
+#define TRACE_RING_SIZE (1 << 16)
+#define TRACE_EVENT_SIZE 512
+#ifdef SHELL_TRACE
+#define TRACE(level, ...)                                                      \
+  do {                                                                         \
+    if (trace_level >= (level)) {                                              \
+      trace_event(__VA_ARGS__);                                                \
+    }                                                                          \
+  } while (0)
+#else
+#define TRACE(level, ...)                                                      \
+  do {                                                                         \
+  } while (0)
+#endif
+
+extern char **environ;
+
+// Token as a view into the text scanned from a line
+struct token {
+  size_t off;
+  size_t len;
+  int op; // Unquoted run of "&" or "|"
+};
+
+// Per line allocations, released all at once by arena_reset
+struct arena_block {
+  struct arena_block *next;
+  size_t used;
+  size_t cap;
+  char data[];
+};
+struct arena {
+  struct arena_block *head;
+  size_t total;
+};
+
+// Resources used by the children of a "time" prefixed line, chain or
+// command (and of the scopes it is part of)
+struct timing {
+  long start_ns;
+  long utime_us;
+  long stime_us;
+  long maxrss_kb;
+  long nvcsw;
+  long nivcsw;
+  struct timing *parent;
+};
+
+// Child process of the shell, found by PID through proc_table
+struct proc {
+  int pid;
+  int status;
+  int done;
+  int background;
+  // Wall time from launch to reap, and resources used
+  long start_ns;
+  long end_ns;
+  struct rusage ru;
+  struct timing *timing;
+  // Where it was placed (index into topology.cpus), -1 if it wasn't
+  int place;
+  // Called when the child ends, it then owns the record
+  void (*on_exit)(struct proc *p);
+  void *data;
+  struct proc *next;
+};
+
+// PID to proc hash map, with a free list of proc records
+struct proc_table {
+  struct proc **buckets;
+  size_t nbuckets;
+  size_t count;
+  struct proc *free;
+};
+
+// "&&&" segments of a line, at most max_jobs of them running at once
+struct fanout {
+  char ***segments;
+  int count;
+  int next;
+  int running;
+  int filling;
+  struct timing *timing;
+  // Where its chains are allocated, the stdin, stdout and stderr they get
+  // (NULL to inherit the shell's) and the first failing status
+  struct arena *arena;
+  const int *fds;
+  int status;
+  // Called once every segment has ended (NULL when the caller waits)
+  void (*on_done)(struct fanout *f);
+  void *data;
+  // Line it is part of, and where the shell's messages about it go (NULL
+  // for its stdout)
+  struct line_group *group;
+  struct output_queue *msgs;
+  // When segments were queued
+  long queued_ns;
+};
+
+// "&&" chain of commands, advanced from the event loop as its children end
+struct chain {
+  char **rest;
+  int pending;
+  int last_pid;
+  int status;
+  int done;
+  // Builtins run in the shell itself, otherwise in a forked shell
+  int in_shell;
+  struct fanout *fanout;
+  struct line_group *group;
+  // Scope of the chain's children, and that of its current command if it
+  // is timed
+  struct timing *timing;
+  struct timing *cmd_timing;
+  int timed;
+  // Descriptors its commands get for stdin, stdout and stderr (-1 to
+  // inherit), and the captures reading them
+  int fds[3];
+  struct capture *capture;
+  // Where its children are placed (index into topology.cpus), -1 for none
+  int place;
+  // Current command, when it started, its watchdog if it has a timeout and
+  // whether it was signaled for running out of time
+  const char *cmd;
+  long cmd_start_ns;
+  struct watchdog *watchdog;
+  int timed_out;
+  // A timed command runs in its own process group, so the watchdog reaches
+  // what its children start (0 until its first child leads it)
+  int own_group;
+  int pgid;
+  // Called when the chain is done (segments of a line, steps of a dag)
+  void (*on_done)(struct chain *c);
+  void *data;
+  struct arena *arena;
+};
+
+// Step of a dag: a chain run once the steps it needs have succeeded
+struct dag_step {
+  const char *name;
+  char **dep_names;
+  char **tokens;
+  int *deps;
+  int ndeps;
+  int *users;
+  int nusers;
+  // Dependencies not done yet, and whether one of them failed
+  int waiting;
+  int failed_dep;
+  // Expected time from its start to the end of the longest path after it
+  long rank_ns;
+  int state;
+  int status;
+  long start_ns;
+  long end_ns;
+  struct chain chain;
+  struct dag *dag;
+};
+
+// Steps of a "dag" file, with those ready to run in a max-heap by rank
+struct dag {
+  struct dag_step *steps;
+  int count;
+  int *ready;
+  int nready;
+  int running;
+  int filling;
+  long start_ns;
+};
+
+// How long a dag step took when it last ran, by step name
+struct dag_estimate {
+  struct dag_estimate *next;
+  long ns;
+  char name[];
+};
+
+// Log-bucketed histogram (as HDR histograms): 2^HIST_SUB_BITS buckets per
+// power of two, so values are kept to within 1/16
+struct histogram {
+  long count;
+  long sum;
+  long min;
+  long max;
+  long buckets[HIST_BUCKETS];
+};
+
+// File descriptor watched by the event loop
+struct event_source {
+  int fd;
+  void (*handler)(struct event_source *src, unsigned events);
+  void *data;
+};
+
+// CPU policy, nice value and I/O class to run a child with
+struct priority {
+  int policy;
+  int nice;
+  int io_idle;
+};
+
+// Command sent to a pre-forked process, followed by len bytes of strings
+// (path, working directory, arguments, environment) and with its stdin,
+// stdout and stderr attached
+struct zygote_request {
+  int pgid;
+  int argc;
+  int envc;
+  int len;
+};
+
+// NUMA nodes and the CPUs of each that the shell may use, read once
+struct topology {
+  int loaded;
+  cpu_set_t allowed;
+  int nnodes;
+  int node_id[TOPOLOGY_MAX_NODES];
+  cpu_set_t node_cpus[TOPOLOGY_MAX_NODES];
+  // CPUs grouped by node, and the node (index) of each
+  int ncpus;
+  int cpus[CPU_SETSIZE];
+  int cpu_node[CPU_SETSIZE];
+};
+
+// Output of a "&&&" segment read from a pipe, emitted to out (1 or 2)
+struct capture {
+  struct event_source src;
+  int out;
+  int segment;
+  char *buf;
+  size_t len;
+  size_t cap;
+};
+
+// Block of captured output waiting to be written
+struct out_chunk {
+  struct out_chunk *next;
+  int fd;
+  size_t len;
+  size_t off;
+  char data[];
+};
+
+// Captured output, written in order without blocking the event loop
+struct output_queue {
+  struct out_chunk *head;
+  struct out_chunk *tail;
+  // Where to write stdout and stderr blocks (opened from to, NULL for the
+  // shell's own), whether they are sockets, and which one is full
+  int fds[3];
+  int sock[3];
+  const int *to;
+  struct event_source src;
+  int waiting;
+};
+
+// Command run by the shell itself
+struct builtin_cmd {
+  const char *name;
+  // Exit code, or BUILTIN_PENDING after adding to c->pending.
+  // c is NULL in a forked shell
+  int (*fn)(char **tokens, struct chain *c);
+  // Run in a forked shell: always (1, it streams its input), only when it
+  // reads stdin (BUILTIN_FORKS_STDIN) or never (0)
+  int forks;
+};
+
+// Chain waiting on a timer of the sleep builtin
+struct sleeper {
+  struct event_source src;
+  struct chain *chain;
+  struct sleeper *next;
+  struct sleeper **link;
+};
+
+// Process group of a foreground line being run (of the terminal or of a
+// client), which has the terminal while children of the line run (members
+// of it not reaped yet). Once cancelled (Ctrl-C), what is left of it gets
+// SIGKILL from kill_timer KILL_GRACE_MS later. Once stopped (cancelled or
+// at its deadline), nothing else of it starts
+struct line_group {
+  int active;
+  int pgid;
+  int members;
+  int tty;
+  long cancel_ns;
+  int reaped;
+  int killed;
+  int stopped;
+  struct event_source kill_timer;
+};
+
+// Connection of a client in server mode, its descriptors and unread input
+struct client {
+  struct event_source src;
+  int fds[3];
+  char buf[CLIENT_BUFFER_SIZE];
+  size_t len;
+  int reading;
+  int busy;
+  int starting;
+  int hung_up;
+  struct arena arena;
+  struct fanout f;
+  // Its line's process group and deadline, and where the shell's messages
+  // about it go (the client's stderr)
+  struct line_group group;
+  struct watchdog *deadline;
+  struct output_queue out;
+};
+
+// Timer of a command with a timeout (or of a line with a deadline, chain
+// being NULL)
+struct watchdog {
+  struct event_source src;
+  struct chain *chain;
+  struct line_group *group;
+  int fired;
+};
+
+
+// Command name resolved to the path of its executable
+struct hash_entry {
+  char *name;
+  char *path;
+  long hits;
+  struct hash_entry *next;
+};
+
+// Command hash table, valid for the PATH it was filled with
+struct cmd_hash {
+  struct hash_entry **buckets;
+  size_t nbuckets;
+  size_t count;
+  char *path_env;
+  long hits;
+  long misses;
+};
+
+// Buffered line reader over a file descriptor
+struct reader {
+  int fd;
+  char *buf;
+  size_t cap;
+  size_t start;
+  size_t end;
+  int eof;
+};
+
+// Lines run so far, in a log file appended to by every shell and mapped to
+// be searched
+struct history {
+  int fd;
+  int record;
+  char *map;
+  size_t mapped;
+  // Start of each complete line, offs[count] is the end of the last one
+  size_t *offs;
+  int count;
+  int cap;
+  // Indexes of the first lines, built on demand: line numbers sorted by
+  // text with a max tree over them (prefixes), and line numbers per trigram
+  // bucket (substrings)
+  int sorted_lines;
+  int *sorted;
+  int *latest;
+  int trigram_lines;
+  int *tri_start;
+  int *tri_lines;
+};
+
+// Listing of a directory, read again only once its mtime changes
+struct dir_cache {
+  char *path;
+  struct timespec mtime;
+  // Open while being read, a batch at a time
+  int fd;
+  int complete;
+  // Each name after a byte with its type
+  char *names;
+  size_t used;
+  size_t cap;
+  int count;
+  char **sorted;
+  struct dir_cache *next;
+};
+
+// Names in the PATH directories, for command completion
+struct path_index {
+  char *path_env;
+  struct dir_cache **dirs;
+  int ndirs;
+  // Next directory to list in the background
+  int next;
+  char **names;
+  int count;
+  int stale;
+};
+
+// Line editor of the interactive shell
+struct editor {
+  const char *prompt;
+  char *buf;
+  size_t len;
+  size_t cap;
+  size_t pos;
+  int tabs;
+  // Line of history shown (-1 for the typed one, kept in typed)
+  int hist;
+  char *typed;
+  // Input read ahead
+  char in[EDITOR_INPUT_SIZE];
+  size_t in_start;
+  size_t in_end;
+  struct termios saved;
+};
+
+// Line being sorted by history_index, with its first 16 bytes
+struct history_key {
+  unsigned long key[2];
+  int line;
+};
+
+struct proc_table procs;
+int max_jobs;
 int interrupt;
 
+// Event loop: SIGCHLD arrives through a self-pipe
+int epoll_fd = -1;
+int sigchld_pipe[2] = {-1, -1};
+volatile sig_atomic_t sigchld_pending;
+volatile long sigchld_ns;
+volatile sig_atomic_t sigint_pending;
+struct event_source sigchld_source;
+int at_prompt;
+struct sleeper *sleepers;
+int last_status;
+
+// Time a line may run (0 for no limit)
+long deadline_ns;
+
+struct dag_estimate *dag_estimates;
+struct arena line_arena;
+struct line_group fg_group = {.tty = -1, .kill_timer = {.fd = -1}};
+
+// Bytes scan() has to look at, and how it marks them in a line (picked for
+// the CPU by scan_init)
+const unsigned char special_bytes[256] = {
+    [' '] = 1, ['\t'] = 1, ['\n'] = 1, ['\''] = 1,
+    ['"'] = 1, ['\\'] = 1, ['&'] = 1, ['|'] = 1};
+void (*scan_mark)(const char *s, size_t len, uint64_t *bits);
+
+// Operators as tokenize() returns them, told apart by address from the same
+// text quoted
+const char op_bg[] = "&", op_and[] = "&&", op_fanout[] = "&&&", op_pipe[] = "|";
+
+// Executable paths of commands run so far
+struct cmd_hash cmd_hash;
+
+struct history history = {.fd = -1};
+
+// Directory listings for completion, and the PATH index built from them
+struct dir_cache *dir_caches[DIR_BUCKETS];
+struct path_index path_index;
+struct editor editor;
+
+// Work done while waiting at the prompt, returns 0 once there is no more
+int (*idle_step)(void);
+
+// Capacity requested for pipeline pipes (0 keeps the kernel default)
+int pipe_size;
+
+// Where "&&&" segments run: policy, memory binding, and the place of what
+// is being launched (-1 for anywhere)
+int place_policy = PLACE_NONE;
+const char *place_names[] = {"none", "rr", "numa"};
+int place_membind;
+int spawn_place = -1;
+struct topology topology;
+
+// Priority of background jobs, and of what is being launched (NULL to
+// leave it as the shell's)
+const char *sched_names[] = {"normal", "batch", "idle"};
+const int sched_policies[] = {SCHED_OTHER, SCHED_BATCH, SCHED_IDLE};
+struct priority bg_priority = {SCHED_OTHER, 0, 0};
+const struct priority *spawn_priority;
+
+// How output of "&&&" segments reaches the terminal
+int output_mode = OUTPUT_DIRECT;
+const char *output_names[] = {"direct", "group", "prefix"};
+struct output_queue output;
+
+// What the shell prints while it works on a client's line goes to a memory
+// stream (stdout meanwhile), queued to the client's stderr after
+struct client_msgs {
+  struct output_queue *to;
+  FILE *saved;
+  char *buf;
+  size_t len;
+} msgs;
+
+// Launch engine used by spawn()
+int spawn_mode = SPAWN_POSIX;
+const char *spawn_names[] = {"fork", "posix", "zygote"};
+
+// Counters and histograms of the stats builtin (in nanoseconds but for
+// width): launch latency by engine and of forked builtins, launch to
+// reap, SIGCHLD to reap, wait of "&&&" segments for a slot and segments
+// per line
+struct stats {
+  struct histogram spawn[3];
+  struct histogram fork;
+  struct histogram runtime;
+  struct histogram reap;
+  struct histogram queue;
+  struct histogram width;
+  long exec_failures;
+} stats;
+
+// Helper forked early, and processes it pre-forked for launching commands
+// (with the sockets to hand them a command through)
+struct zygote {
+  int pid;
+  int fd;
+  int ready_pid[ZYGOTE_POOL];
+  int ready_fd[ZYGOTE_POOL];
+  int nready;
+  long fallbacks;
+} zygote;
+
+#ifdef SHELL_TRACE
+// Trace events (one JSON object per line) wait in a ring until flushed.
+// Everything is traced unless -T or "set trace" says otherwise
+int trace_level = TRACE_CMD;
+struct trace_ring {
+  char buf[TRACE_RING_SIZE];
+  size_t head;
+  size_t len;
+  int fd;
+} trace_ring = {.fd = STDERR_FILENO};
+#endif
+
+/**
+ * @fn arena_alloc
+ * @param[in] a
+ * @param[in] size
+ * @return pointer to size bytes, valid until the next arena_reset
+ * @brief Bump allocate from the arena, chaining a new block when full
+ */
+void *arena_alloc(struct arena *a, size_t size) {
+  struct arena_block *b = a->head;
+
+  // Keep every allocation pointer aligned
+  size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+  if (b == NULL || b->used + size > b->cap) {
+    size_t cap = ARENA_BLOCK_SIZE;
+    while (cap < size) {
+      cap *= 2;
+    }
+    b = (struct arena_block *)malloc(sizeof(struct arena_block) + cap);
+    if (b == NULL) {
+      printf("Shell: Out of memory\n");
+      exit(1);
+    }
+    b->next = a->head;
+    b->used = 0;
+    b->cap = cap;
+    a->head = b;
+    a->total += cap;
+  }
+
+  void *p = b->data + b->used;
+  b->used += size;
+  return p;
+}
+
+/**
+ * @fn arena_reset
+ * @param[in] a
+ * @brief Release everything allocated from the arena.
+ *        If the last use needed more than one block, they are merged into a
+ *        single block big enough for it, so a line of that size fits next time
+ */
+void arena_reset(struct arena *a) {
+  struct arena_block *b = a->head;
+
+  if (b == NULL) {
+    return;
+  }
+  if (b->next != NULL) {
+    size_t total = a->total;
+    while (b != NULL) {
+      struct arena_block *next = b->next;
+      free(b);
+      b = next;
+    }
+    a->head = NULL;
+    a->total = 0;
+    arena_alloc(a, total);
+    b = a->head;
+  }
+  b->used = 0;
+}
+
+/**
+ * @fn mark_scalar
+ * @param[in] s
+ * @param[in] len
+ * @param[out] bits One bit per byte of s, set for those scan() has to look
+ *                  at: whitespace, quotes, backslashes, "&" and "|"
+ *                  ((len + 63) / 64 words)
+ */
+void mark_scalar(const char *s, size_t len, uint64_t *bits) {
+  size_t i;
+
+  memset(bits, 0, (len + 63) / 64 * sizeof(uint64_t));
+  for (i = 0; i < len; ++i) {
+    bits[i / 64] |= (uint64_t)special_bytes[(unsigned char)s[i]] << (i % 64);
+  }
+}
+
+#ifdef SCAN_X86
+/**
+ * @fn mark_sse2
+ * @param[in] s
+ * @param[in] len
+ * @param[out] bits
+ * @brief Same as mark_scalar, comparing 16 bytes at a time
+ */
+void mark_sse2(const char *s, size_t len, uint64_t *bits) {
+  const __m128i sp = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t');
+  const __m128i nl = _mm_set1_epi8('\n'), sq = _mm_set1_epi8('\'');
+  const __m128i dq = _mm_set1_epi8('"'), bs = _mm_set1_epi8('\\');
+  const __m128i amp = _mm_set1_epi8('&'), bar = _mm_set1_epi8('|');
+  size_t i, k, full = len / 64 * 64;
+
+  for (i = 0; i < full; i += 64) {
+    uint64_t word = 0;
+    for (k = 0; k < 64; k += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(s + i + k));
+      __m128i m = _mm_or_si128(
+          _mm_or_si128(
+              _mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, tab)),
+              _mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, sq))),
+          _mm_or_si128(
+              _mm_or_si128(_mm_cmpeq_epi8(v, dq), _mm_cmpeq_epi8(v, bs)),
+              _mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, bar))));
+      word |= (uint64_t)(unsigned)_mm_movemask_epi8(m) << k;
+    }
+    bits[i / 64] = word;
+  }
+  if (full < len) {
+    mark_scalar(s + full, len - full, bits + full / 64);
+  }
+}
+
+/**
+ * @fn mark_avx2
+ * @param[in] s
+ * @param[in] len
+ * @param[out] bits
+ * @brief Same as mark_scalar, comparing 32 bytes at a time
+ */
+__attribute__((target("avx2"))) void mark_avx2(const char *s, size_t len,
+                                                uint64_t *bits) {
+  const __m256i sp = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t');
+  const __m256i nl = _mm256_set1_epi8('\n'), sq = _mm256_set1_epi8('\'');
+  const __m256i dq = _mm256_set1_epi8('"'), bs = _mm256_set1_epi8('\\');
+  const __m256i amp = _mm256_set1_epi8('&'), bar = _mm256_set1_epi8('|');
+  size_t i, k, full = len / 64 * 64;
+
+  for (i = 0; i < full; i += 64) {
+    uint64_t word = 0;
+    for (k = 0; k < 64; k += 32) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(s + i + k));
+      __m256i m = _mm256_or_si256(
+          _mm256_or_si256(
+              _mm256_or_si256(_mm256_cmpeq_epi8(v, sp),
+                              _mm256_cmpeq_epi8(v, tab)),
+              _mm256_or_si256(_mm256_cmpeq_epi8(v, nl),
+                              _mm256_cmpeq_epi8(v, sq))),
+          _mm256_or_si256(
+              _mm256_or_si256(_mm256_cmpeq_epi8(v, dq),
+                              _mm256_cmpeq_epi8(v, bs)),
+              _mm256_or_si256(_mm256_cmpeq_epi8(v, amp),
+                              _mm256_cmpeq_epi8(v, bar))));
+      word |= (uint64_t)(unsigned)_mm256_movemask_epi8(m) << k;
+    }
+    bits[i / 64] = word;
+  }
+  if (full < len) {
+    mark_scalar(s + full, len - full, bits + full / 64);
+  }
+}
+#endif
+
+/**
+ * @fn scan_init
+ * @brief Pick the fastest way to mark special bytes this CPU has
+ */
+void scan_init(void) {
+  scan_mark = mark_scalar;
+#ifdef SCAN_X86
+  scan_mark = mark_sse2;
+  if (__builtin_cpu_supports("avx2")) {
+    scan_mark = mark_avx2;
+  }
+#endif
+}
+
+/**
+ * @fn next_special
+ * @param[in] bits As marked by scan_mark
+ * @param[in] i
+ * @param[in] len
+ * @return index of the first marked byte from i on, len if there is none
+ */
+size_t next_special(const uint64_t *bits, size_t i, size_t len) {
+  size_t w = i / 64, words = (len + 63) / 64;
+  uint64_t word;
+
+  if (i >= len) {
+    return len;
+  }
+  word = bits[w] & (~(uint64_t)0 << (i % 64));
+  while (word == 0) {
+    if (++w == words) {
+      return len;
+    }
+    word = bits[w];
+  }
+  return w * 64 + __builtin_ctzll(word);
+}
+
+/**
+ * @fn scan
+ * @param[in] line
+ * @param[in] len
+ * @param[out] bits Special bytes of line ((len + 63) / 64 words)
+ * @param[out] out Text of the tokens, each terminated (2 * len + 1 bytes at
+ *                 most, with the terminators)
+ * @param[out] views Tokens as (offset, length) in out (len at most)
+ * @return number of tokens found, -1 if a quote isn't closed
+ * @brief Find the tokens of line in one pass. Whitespace separates them,
+ *        runs of "&" or "|" are tokens of their own. Text in single quotes
+ *        is taken as is, in double quotes backslash escapes \, ", $ and `,
+ *        and elsewhere it escapes any character.
+ *        Bytes that matter are marked first by scan_mark, many at a time,
+ *        then only those are looked at
+ */
+ssize_t scan(const char *line, size_t len, uint64_t *bits, char *out,
+             struct token *views) {
+  size_t i = 0, j, o = 0, n = 0;
+  int in_token = 0;
+  char quote = 0, ch;
+
+  scan_mark(line, len, bits);
+  while (i < len) {
+    // Copy ordinary bytes up to the next one that matters
+    j = next_special(bits, i, len);
+    if (j > i) {
+      if (!in_token) {
+        views[n].off = o;
+        views[n].op = 0;
+        in_token = 1;
+      }
+      memcpy(out + o, line + i, j - i);
+      o += j - i;
+      i = j;
+      if (i == len) {
+        break;
+      }
+    }
+
+    ch = line[i];
+    if (quote != 0) {
+      if (ch == quote) {
+        quote = 0;
+      } else if (quote == '"' && ch == '\\' && i + 1 < len &&
+                 strchr("\\\"$`", line[i + 1]) != NULL) {
+        out[o++] = line[++i];
+      } else {
+        out[o++] = ch;
+      }
+      ++i;
+      continue;
+    }
+
+    if (ch == ' ' || ch == '\t' || ch == '\n' || ch == '&' || ch == '|') {
+      // End of the token
+      if (in_token) {
+        out[o++] = '\0';
+        views[n].len = o - 1 - views[n].off;
+        n++;
+        in_token = 0;
+      }
+      if (ch == '&' || ch == '|') {
+        views[n].off = o;
+        views[n].op = 1;
+        for (j = i; j < len && line[j] == ch; ++j) {
+          out[o++] = ch;
+        }
+        out[o++] = '\0';
+        views[n++].len = j - i;
+        i = j;
+      } else {
+        ++i;
+      }
+      continue;
+    }
+
+    // Quote or backslash, part of a token (maybe an empty one: "")
+    if (!in_token) {
+      views[n].off = o;
+      views[n].op = 0;
+      in_token = 1;
+    }
+    if (ch == '\\') {
+      if (i + 1 < len) {
+        out[o++] = line[i + 1];
+      }
+      i += 2;
+    } else {
+      quote = ch;
+      ++i;
+    }
+  }
+
+  if (quote != 0) {
+    return -1;
+  }
+  if (in_token) {
+    out[o++] = '\0';
+    views[n].len = o - 1 - views[n].off;
+    n++;
+  }
+  return n;
+}
+
+/**
+ * @fn tokenize
+ * @param[in] line
+ * @param[in] a
+ * @return tokens (none if a quote isn't closed)
+ * @brief Split line into tokens.
+ *        Operators are op_bg, op_and, op_fanout or op_pipe themselves, other
+ *        tokens and the token array are taken from the arena
+ */
+char **tokenize(char *line, struct arena *a) {
+  static const char *const ops[] = {op_bg, op_and, op_fanout, op_pipe};
+  size_t len = strlen(line), k;
+  ssize_t n, i;
+
+  if (scan_mark == NULL) {
+    scan_init();
+  }
+
+  // Every token takes at least one byte of the line
+  struct token *views =
+      (struct token *)arena_alloc(a, (len + 1) * sizeof(struct token));
+  uint64_t *bits =
+      (uint64_t *)arena_alloc(a, (len + 63) / 64 * sizeof(uint64_t));
+  char *out = (char *)arena_alloc(a, 2 * len + 1);
+  n = scan(line, len, bits, out, views);
+  if (n == -1) {
+    printf("Shell: Unterminated quote\n");
+    n = 0;
+  }
+
+  char **tokens = (char **)arena_alloc(a, (n + 1) * sizeof(char *));
+  for (i = 0; i < n; i++) {
+    tokens[i] = out + views[i].off;
+    for (k = 0; views[i].op && k < sizeof(ops) / sizeof(ops[0]); ++k) {
+      if (!strcmp(tokens[i], ops[k])) {
+        tokens[i] = (char *)ops[k];
+      }
+    }
+  }
+  tokens[n] = NULL;
+  return tokens;
+}
+
+/**
+ * @fn reader_init
+ * @param[in] r
+ * @param[in] fd
+ * @brief Start reading lines from fd
+ */
+void reader_init(struct reader *r, int fd) {
+  r->fd = fd;
+  r->cap = READ_BUFFER_SIZE;
+  r->buf = (char *)malloc(r->cap);
+  r->start = r->end = 0;
+  r->eof = 0;
+  if (r->buf == NULL) {
+    printf("Shell: Out of memory\n");
+    exit(1);
+  }
+}
+
+/**
+ * @fn reader_getline
+ * @param[in] r
+ * @return next line without its newline, NULL at end of input
+ * @brief Read the next line of any length through the buffer.
+ *        The line stays valid (and writable) until the next call
+ */
+char *reader_getline(struct reader *r) {
+  size_t scanned = r->start;
+
+  while (1) {
+    char *nl = (char *)memchr(r->buf + scanned, '\n', r->end - scanned);
+    if (nl != NULL) {
+      char *line = r->buf + r->start;
+      *nl = '\0';
+      r->start = nl - r->buf + 1;
+      return line;
+    }
+    scanned = r->end;
+
+    if (r->eof) {
+      // Last line without a newline
+      if (r->start == r->end) {
+        return NULL;
+      }
+      char *line = r->buf + r->start;
+      r->buf[r->end] = '\0';
+      r->start = r->end;
+      return line;
+    }
+
+    // Move the partial line to the front, grow if it fills the buffer
+    if (r->start > 0) {
+      memmove(r->buf, r->buf + r->start, r->end - r->start);
+      r->end -= r->start;
+      scanned -= r->start;
+      r->start = 0;
+    }
+    if (r->end + 1 == r->cap) {
+      r->cap *= 2;
+      r->buf = (char *)realloc(r->buf, r->cap);
+      if (r->buf == NULL) {
+        printf("Shell: Out of memory\n");
+        exit(1);
+      }
+    }
+
+    // Keep one byte spare for the terminating '\0'
+    ssize_t n = read(r->fd, r->buf + r->end, r->cap - r->end - 1);
+    if (n > 0) {
+      r->end += n;
+    } else if (n == 0 || errno != EINTR) {
+      r->eof = 1;
+    }
+  }
+}
+
+/**
+ * @fn now_ns
+ * @return monotonic time in nanoseconds
+ */
+long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+#ifdef SHELL_TRACE
+/**
+ * @fn trace_flush
+ * @brief Write the pending trace events to the trace file descriptor
+ */
+void trace_flush(void) {
+  struct trace_ring *t = &trace_ring;
+  struct iovec iov[2];
+  ssize_t ret;
+
+  while (t->len > 0) {
+    // Pending bytes may wrap around the end of the buffer
+    size_t first = TRACE_RING_SIZE - t->head;
+    if (first > t->len) {
+      first = t->len;
+    }
+    iov[0].iov_base = t->buf + t->head;
+    iov[0].iov_len = first;
+    iov[1].iov_base = t->buf;
+    iov[1].iov_len = t->len - first;
+    ret = writev(t->fd, iov, iov[1].iov_len > 0 ? 2 : 1);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      // Nowhere to write, drop them
+      t->len = 0;
+      break;
+    }
+    t->head = (t->head + ret) % TRACE_RING_SIZE;
+    t->len -= ret;
+  }
+}
+
+/**
+ * @fn trace_put
+ * @param[in] data
+ * @param[in] len
+ * @brief Append to the trace ring, flushing it first if it is full
+ */
+void trace_put(const char *data, size_t len) {
+  struct trace_ring *t = &trace_ring;
+
+  if (t->len + len > TRACE_RING_SIZE) {
+    trace_flush();
+  }
+  size_t tail = (t->head + t->len) % TRACE_RING_SIZE;
+  size_t first = TRACE_RING_SIZE - tail;
+  if (first > len) {
+    first = len;
+  }
+  memcpy(t->buf + tail, data, first);
+  memcpy(t->buf, data + first, len - first);
+  t->len += len;
+}
+
+/**
+ * @fn trace_event
+ * @param[in] event Name of the event
+ * @param[in] fmt printf format of the other fields, as JSON members
+ * @brief Record a timestamped event
+ */
+void trace_event(const char *event, const char *fmt, ...) {
+  char buf[TRACE_EVENT_SIZE];
+  va_list ap;
+  int n, m;
+  int saved = errno;
+
+  n = snprintf(buf, sizeof(buf), "{\"ts\":%ld,\"event\":\"%s\",", now_ns(),
+               event);
+  va_start(ap, fmt);
+  m = vsnprintf(buf + n, sizeof(buf) - n - 2, fmt, ap);
+  va_end(ap);
+  // Keep the line whole even if the fields were cut
+  n += m < (int)sizeof(buf) - n - 2 ? m : (int)sizeof(buf) - n - 3;
+  buf[n++] = '}';
+  buf[n++] = '\n';
+  trace_put(buf, n);
+  // Callers may still look at errno
+  errno = saved;
+}
+
+/**
+ * @fn trace_str
+ * @param[in] str
+ * @return str escaped for a JSON string (in a static buffer, so only one per
+ *         event), cut if too long
+ */
+const char *trace_str(const char *str) {
+  static char buf[TRACE_EVENT_SIZE / 2];
+  size_t n = 0;
+
+  for (; str != NULL && *str != '\0' && n + 7 < sizeof(buf); ++str) {
+    unsigned char ch = *str;
+    if (ch == '"' || ch == '\\') {
+      buf[n++] = '\\';
+      buf[n++] = ch;
+    } else if (ch < 0x20) {
+      n += sprintf(buf + n, "\\u%04x", ch);
+    } else {
+      buf[n++] = ch;
+    }
+  }
+  buf[n] = '\0';
+  return buf;
+}
+#endif
+
+/**
+ * @fn proc_bucket
+ * @param[in] pid
+ * @return head of the hash chain of pid
+ */
+struct proc **proc_bucket(int pid) {
+  return &procs.buckets[(unsigned)pid & (procs.nbuckets - 1)];
+}
+
+/**
+ * @fn proc_add
+ * @param[in] pid
+ * @param[in] background
+ * @return record of the new child
+ * @brief Start tracking a child process.
+ *        The table doubles when it is as full as it has buckets
+ */
+struct proc *proc_add(int pid, int background) {
+  size_t i;
+  struct proc *p;
+
+  if (procs.count >= procs.nbuckets) {
+    struct proc **old = procs.buckets;
+    size_t n = procs.nbuckets;
+    procs.nbuckets = n ? 2 * n : PROC_BATCH;
+    procs.buckets = (struct proc **)calloc(procs.nbuckets, sizeof(p));
+    if (procs.buckets == NULL) {
+      printf("Shell: Out of memory\n");
+      exit(1);
+    }
+    for (i = 0; i < n; ++i) {
+      while ((p = old[i]) != NULL) {
+        old[i] = p->next;
+        p->next = *proc_bucket(p->pid);
+        *proc_bucket(p->pid) = p;
+      }
+    }
+    free(old);
+  }
+
+  if (procs.free == NULL) {
+    p = (struct proc *)malloc(PROC_BATCH * sizeof(struct proc));
+    if (p == NULL) {
+      printf("Shell: Out of memory\n");
+      exit(1);
+    }
+    for (i = 0; i < PROC_BATCH; ++i) {
+      p[i].next = procs.free;
+      procs.free = &p[i];
+    }
+  }
+
+  p = procs.free;
+  procs.free = p->next;
+  memset(p, 0, sizeof(*p));
+  p->pid = pid;
+  p->start_ns = now_ns();
+  p->background = background;
+  p->place = -1;
+  p->next = *proc_bucket(pid);
+  *proc_bucket(pid) = p;
+  procs.count++;
+  return p;
+}
+
+/**
+ * @fn proc_find
+ * @param[in] pid
+ * @return record of the child, NULL if it isn't tracked
+ */
+struct proc *proc_find(int pid) {
+  struct proc *p;
+
+  if (procs.nbuckets == 0) {
+    return NULL;
+  }
+  for (p = *proc_bucket(pid); p != NULL && p->pid != pid; p = p->next)
+    ;
+  return p;
+}
+
+/**
+ * @fn proc_remove
+ * @param[in] p
+ * @brief Stop tracking a child and put its record on the free list
+ */
+void proc_remove(struct proc *p) {
+  struct proc **link = proc_bucket(p->pid);
+
+  while (*link != p) {
+    link = &(*link)->next;
+  }
+  *link = p->next;
+  p->next = procs.free;
+  procs.free = p;
+  procs.count--;
+}
+
+/**
+ * @fn timing_start
+ * @param[in] a Arena of the line
+ * @param[in] parent Enclosing scope, NULL if none
+ * @return new timing scope, starting now
+ */
+struct timing *timing_start(struct arena *a, struct timing *parent) {
+  struct timing *t = (struct timing *)arena_alloc(a, sizeof(struct timing));
+
+  memset(t, 0, sizeof(*t));
+  t->start_ns = now_ns();
+  t->parent = parent;
+  return t;
+}
+
+/**
+ * @fn timing_add
+ * @param[in] t
+ * @param[in] ru
+ * @brief Account resources of a reaped child to t and its enclosing scopes
+ */
+void timing_add(struct timing *t, const struct rusage *ru) {
+  for (; t != NULL; t = t->parent) {
+    t->utime_us += ru->ru_utime.tv_sec * 1000000L + ru->ru_utime.tv_usec;
+    t->stime_us += ru->ru_stime.tv_sec * 1000000L + ru->ru_stime.tv_usec;
+    if (ru->ru_maxrss > t->maxrss_kb) {
+      t->maxrss_kb = ru->ru_maxrss;
+    }
+    t->nvcsw += ru->ru_nvcsw;
+    t->nivcsw += ru->ru_nivcsw;
+  }
+}
+
+/**
+ * @fn timing_print
+ * @param[in] t
+ * @brief Print real/user/sys time, max RSS and context switches of t
+ */
+void timing_print(struct timing *t) {
+  long real_us = (now_ns() - t->start_ns) / 1000;
+
+  printf("real    %ld.%06lds\n", real_us / 1000000, real_us % 1000000);
+  printf("user    %ld.%06lds\n", t->utime_us / 1000000, t->utime_us % 1000000);
+  printf("sys     %ld.%06lds\n", t->stime_us / 1000000, t->stime_us % 1000000);
+  printf("maxrss  %ldKB\n", t->maxrss_kb);
+  printf("csw     %ld voluntary, %ld involuntary\n", t->nvcsw, t->nivcsw);
+}
+
+/**
+ * @fn hist_index
+ * @param[in] v
+ * @return bucket of v: values below 2^HIST_SUB_BITS have their own, above
+ *         each power of two is cut into 2^HIST_SUB_BITS buckets
+ */
+int hist_index(long v) {
+  int e;
+
+  if (v < (1L << HIST_SUB_BITS)) {
+    return v < 0 ? 0 : (int)v;
+  }
+  e = 63 - __builtin_clzl(v);
+  return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+         (int)((v >> (e - HIST_SUB_BITS)) & ((1L << HIST_SUB_BITS) - 1));
+}
+
+/**
+ * @fn hist_lowest
+ * @param[in] i Bucket
+ * @return smallest value of the bucket
+ */
+long hist_lowest(int i) {
+  int e = (i >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+
+  if (i < (1 << HIST_SUB_BITS)) {
+    return i;
+  }
+  return ((1L << HIST_SUB_BITS) + (i & ((1 << HIST_SUB_BITS) - 1)))
+         << (e - HIST_SUB_BITS);
+}
+
+/**
+ * @fn hist_record
+ * @param[in] h
+ * @param[in] v
+ */
+void hist_record(struct histogram *h, long v) {
+  if (h->count == 0 || v < h->min) {
+    h->min = v;
+  }
+  if (v > h->max) {
+    h->max = v;
+  }
+  h->count++;
+  h->sum += v;
+  h->buckets[hist_index(v)]++;
+}
+
+/**
+ * @fn hist_percentile
+ * @param[in] h
+ * @param[in] q Between 0 and 1
+ * @return value below which a fraction q of the values are (the highest of
+ *         its bucket, at most the largest value recorded)
+ */
+long hist_percentile(const struct histogram *h, double q) {
+  long rank = (long)(q * h->count + 0.5), seen = 0;
+  int i;
+
+  if (rank < 1) {
+    rank = 1;
+  }
+  for (i = 0; i < HIST_BUCKETS; ++i) {
+    seen += h->buckets[i];
+    if (seen >= rank) {
+      return i + 1 < HIST_BUCKETS && hist_lowest(i + 1) - 1 < h->max
+                 ? hist_lowest(i + 1) - 1
+                 : h->max;
+    }
+  }
+  return h->max;
+}
+
+int exit_code(int status);
+void editor_redraw(void);
+
+/**
+ * @fn reap
+ * @brief Reap every child that has ended (only those, so the cost is in the
+ *        number of finished children). Background ones are reported and
+ *        forgotten, foreground ones are left for their waiter
+ */
+void reap(void) {
+  struct rusage ru;
+  int pid, status;
+  long signaled = sigchld_ns;
+
+  // A SIGCHLD coming in meanwhile is timed for the next round
+  sigchld_ns = 0;
+  while ((pid = wait4(-1, &status, WNOHANG, &ru)) > 0) {
+    struct proc *p = proc_find(pid);
+    if (p == NULL) {
+      continue;
+    }
+    p->status = status;
+    p->done = 1;
+    p->end_ns = now_ns();
+    p->ru = ru;
+    hist_record(&stats.runtime, p->end_ns - p->start_ns);
+    if (signaled > 0) {
+      hist_record(&stats.reap, p->end_ns - signaled);
+    }
+    timing_add(p->timing, &ru);
+    TRACE(TRACE_PROC, "reap",
+          "\"pid\":%d,\"status\":%d,\"runtime_ns\":%ld,\"utime_us\":%ld,"
+          "\"stime_us\":%ld,\"background\":%d",
+          pid, exit_code(status), p->end_ns - p->start_ns,
+          ru.ru_utime.tv_sec * 1000000L + ru.ru_utime.tv_usec,
+          ru.ru_stime.tv_sec * 1000000L + ru.ru_stime.tv_usec, p->background);
+    if (p->on_exit != NULL) {
+      p->on_exit(p);
+    } else if (p->background) {
+      // At the prompt, the line being typed goes below the message
+      printf(at_prompt ? "\r\x1b[KShell: Background process finished\n"
+                       : "Shell: Background process finished\n");
+      fflush(stdout);
+      if (at_prompt) {
+        editor_redraw();
+      }
+      proc_remove(p);
+    }
+  }
+}
+
+/**
+ * @fn handle_sigchld
+ * @param[in] sig
+ * @brief SIGCHLD handler
+ *        Wakes up the event loop, reaping is done there
+ */
+void handle_sigchld(int sig) {
+  int saved = errno;
+  if (!sigchld_pending) {
+    sigchld_ns = now_ns();
+  }
+  sigchld_pending = 1;
+  write(sigchld_pipe[1], "", 1);
+  errno = saved;
+}
+
+void sleep_cancel(void);
+void line_cancel(struct line_group *g, int sig);
+
+/**
+ * @fn on_sigchld
+ * @param[in] src
+ * @param[in] events
+ * @brief Event handler of the SIGCHLD self-pipe
+ */
+void on_sigchld(struct event_source *src, unsigned events) {
+  char buf[64];
+
+  while (read(sigchld_pipe[0], buf, sizeof(buf)) > 0)
+    ;
+  sigchld_pending = 0;
+  reap();
+
+  // SIGINT wakes the loop up too, sleeps of the shell end there and the
+  // line's processes get it as well
+  if (sigint_pending) {
+    sigint_pending = 0;
+    line_cancel(&fg_group, SIGINT);
+  }
+  if (interrupt) {
+    sleep_cancel();
+  }
+}
+
+/**
+ * @fn event_add
+ * @param[in] src
+ * @param[in] events
+ * @return 0 on success, -1 on error
+ * @brief Watch src->fd for events (EPOLLIN, ...)
+ */
+int event_add(struct event_source *src, unsigned events) {
+  struct epoll_event ev;
+
+  ev.events = events;
+  ev.data.ptr = src;
+  return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, src->fd, &ev);
+}
+
+/**
+ * @fn event_del
+ * @param[in] src
+ * @brief Stop watching src->fd
+ */
+void event_del(struct event_source *src) {
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, src->fd, NULL);
+}
+
+/**
+ * @fn wait_events
+ * @param[in] timeout In milliseconds, -1 to block
+ * @return number of events handled
+ * @brief Wait for events and run their handlers
+ */
+int wait_events(int timeout) {
+  struct epoll_event events[MAX_EVENTS];
+  int i, n;
+
+  n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+  for (i = 0; i < n; ++i) {
+    struct event_source *src = (struct event_source *)events[i].data.ptr;
+    src->handler(src, events[i].events);
+  }
+  return n > 0 ? n : 0;
+}
+
+/**
+ * @fn events_init
+ * @brief Set up the event loop and the SIGCHLD self-pipe
+ */
+void events_init(void) {
+  struct sigaction sa;
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd == -1 || pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+    printf("Shell: Can't set up the event loop\n");
+    exit(1);
+  }
+  sigchld_source.fd = sigchld_pipe[0];
+  sigchld_source.handler = on_sigchld;
+  event_add(&sigchld_source, EPOLLIN);
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_sigchld;
+  sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  sigaction(SIGCHLD, &sa, NULL);
+}
+
+/**
+ * @fn wait_proc
+ * @param[in] p
+ * @return wait status of the child
+ * @brief Run the event loop until the child ends, then forget it
+ */
+int wait_proc(struct proc *p) {
+  while (!p->done) {
+    wait_events(-1);
+  }
+  int status = p->status;
+  proc_remove(p);
+  return status;
+}
+
+/**
+ * @fn on_readable
+ * @param[in] src
+ * @param[in] events
+ * @brief Event handler that just notes the fd can be read
+ */
+void on_readable(struct event_source *src, unsigned events) {
+  *(int *)src->data = 1;
+}
+
+/**
+ * @fn wait_readable
+ * @param[in] fd
+ * @brief Run the event loop until fd can be read, doing the idle work
+ *        whenever nothing else happens
+ */
+void wait_readable(int fd) {
+  struct event_source src;
+  int ready = 0;
+
+  src.fd = fd;
+  src.handler = on_readable;
+  src.data = &ready;
+  if (event_add(&src, EPOLLIN) == -1) {
+    return;
+  }
+  while (!ready) {
+    if (idle_step == NULL) {
+      wait_events(-1);
+    } else if (wait_events(0) == 0 && !idle_step()) {
+      idle_step = NULL;
+    }
+  }
+  event_del(&src);
+}
+
+/**
+ * @fn hash_name
+ * @param[in] name
+ * @return FNV-1a hash of name
+ */
+size_t hash_name(const char *name) {
+  size_t h = 2166136261u;
+
+  while (*name) {
+    h = (h ^ (unsigned char)*name++) * 16777619u;
+  }
+  return h;
+}
+
+/**
+ * @fn hash_clear
+ * @brief Forget every resolved command
+ */
+void hash_clear(void) {
+  size_t i;
+  struct hash_entry *e;
+
+  for (i = 0; i < cmd_hash.nbuckets; ++i) {
+    while ((e = cmd_hash.buckets[i]) != NULL) {
+      cmd_hash.buckets[i] = e->next;
+      free(e->name);
+      free(e->path);
+      free(e);
+    }
+  }
+  cmd_hash.count = 0;
+}
+
+/**
+ * @fn hash_forget
+ * @param[in] name
+ * @brief Forget the resolved path of one command
+ */
+void hash_forget(const char *name) {
+  struct hash_entry **link, *e;
+
+  if (cmd_hash.nbuckets == 0) {
+    return;
+  }
+  link = &cmd_hash.buckets[hash_name(name) & (cmd_hash.nbuckets - 1)];
+  for (; (e = *link) != NULL; link = &e->next) {
+    if (!strcmp(e->name, name)) {
+      *link = e->next;
+      free(e->name);
+      free(e->path);
+      free(e);
+      cmd_hash.count--;
+      return;
+    }
+  }
+}
+
+/**
+ * @fn path_search
+ * @param[in] name
+ * @return malloc'd path of the executable, NULL if not found in PATH
+ * @brief Walk PATH like execvp does
+ */
+char *path_search(const char *name) {
+  const char *dir = getenv("PATH"), *end;
+  size_t len = strlen(name);
+  struct stat st;
+
+  if (dir == NULL) {
+    dir = "/bin:/usr/bin";
+  }
+  while (1) {
+    end = strchrnul(dir, ':');
+    // An empty entry means the current directory
+    size_t dlen = end == dir ? 1 : end - dir;
+    char *path = (char *)malloc(dlen + len + 2);
+    memcpy(path, end == dir ? "." : dir, dlen);
+    path[dlen] = '/';
+    memcpy(path + dlen + 1, name, len + 1);
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+        access(path, X_OK) == 0) {
+      return path;
+    }
+    free(path);
+    if (*end == '\0') {
+      return NULL;
+    }
+    dir = end + 1;
+  }
+}
+
+/**
+ * @fn hash_lookup
+ * @param[in] name
+ * @return path to execute for the command, NULL if there is none
+ * @brief Resolve the command through the hash table, walking PATH only the
+ *        first time. The table is cleared whenever PATH changes
+ */
+const char *hash_lookup(const char *name) {
+  const char *env = getenv("PATH");
+  struct hash_entry *e;
+  size_t i;
+
+  // Paths are used as given
+  if (strchr(name, '/') != NULL) {
+    return name;
+  }
+
+  if (env == NULL) {
+    env = "";
+  }
+  if (cmd_hash.path_env == NULL || strcmp(cmd_hash.path_env, env)) {
+    hash_clear();
+    free(cmd_hash.path_env);
+    cmd_hash.path_env = strdup(env);
+  }
+
+  if (cmd_hash.nbuckets != 0) {
+    i = hash_name(name) & (cmd_hash.nbuckets - 1);
+    for (e = cmd_hash.buckets[i]; e != NULL; e = e->next) {
+      if (!strcmp(e->name, name)) {
+        e->hits++;
+        cmd_hash.hits++;
+        return e->path;
+      }
+    }
+  }
+
+  cmd_hash.misses++;
+  char *path = path_search(name);
+  if (path == NULL) {
+    return NULL;
+  }
+
+  // Grow by doubling when as full as there are buckets
+  if (cmd_hash.count >= cmd_hash.nbuckets) {
+    struct hash_entry **old = cmd_hash.buckets;
+    size_t n = cmd_hash.nbuckets;
+    cmd_hash.nbuckets = n ? 2 * n : HASH_BUCKETS;
+    cmd_hash.buckets =
+        (struct hash_entry **)calloc(cmd_hash.nbuckets, sizeof(e));
+    for (i = 0; i < n; ++i) {
+      while ((e = old[i]) != NULL) {
+        old[i] = e->next;
+        size_t k = hash_name(e->name) & (cmd_hash.nbuckets - 1);
+        e->next = cmd_hash.buckets[k];
+        cmd_hash.buckets[k] = e;
+      }
+    }
+    free(old);
+  }
+
+  e = (struct hash_entry *)malloc(sizeof(struct hash_entry));
+  e->name = strdup(name);
+  e->path = path;
+  e->hits = 0;
+  i = hash_name(name) & (cmd_hash.nbuckets - 1);
+  e->next = cmd_hash.buckets[i];
+  cmd_hash.buckets[i] = e;
+  cmd_hash.count++;
+  return path;
+}
+
+/**
+ * @fn builtin_hash
+ * @param[in] tokens
+ * @param[in] c
+ * @return exit code
+ * @brief "hash" lists the resolved commands with hit and miss counters,
+ *        "hash -r" forgets them
+ */
+int builtin_hash(char **tokens, struct chain *c) {
+  struct hash_entry *e;
+  size_t i;
+
+  if (tokens[1] != NULL && (strcmp(tokens[1], "-r") || tokens[2] != NULL)) {
+    printf("Shell: Incorrect command\n");
+    return 1;
+  }
+  if (tokens[1] != NULL) {
+    hash_clear();
+    cmd_hash.hits = cmd_hash.misses = 0;
+    return 0;
+  }
+
+  printf("%8s  %s\n", "hits", "command");
+  for (i = 0; i < cmd_hash.nbuckets; ++i) {
+    for (e = cmd_hash.buckets[i]; e != NULL; e = e->next) {
+      printf("%8ld  %s\n", e->hits, e->path);
+    }
+  }
+  printf("hits %ld misses %ld\n", cmd_hash.hits, cmd_hash.misses);
+  return 0;
+}
+
+/**
+ * @fn cpulist_parse
+ * @param[in] s CPU list as in sysfs ("0-3,8-11")
+ * @param[out] set
+ * @return 0 on success, -1 if s isn't a CPU list
+ */
+int cpulist_parse(const char *s, cpu_set_t *set) {
+  long first, last;
+  char *end;
+
+  CPU_ZERO(set);
+  while (*s != '\0' && *s != '\n') {
+    first = last = strtol(s, &end, 10);
+    if (end == s) {
+      return -1;
+    }
+    if (*end == '-') {
+      s = end + 1;
+      last = strtol(s, &end, 10);
+      if (end == s) {
+        return -1;
+      }
+    }
+    for (; first <= last && first < CPU_SETSIZE; ++first) {
+      CPU_SET(first, set);
+    }
+    s = *end == ',' ? end + 1 : end;
+  }
+  return 0;
+}
+
+/**
+ * @fn cpulist_format
+ * @param[in] set
+ * @param[out] buf
+ * @param[in] size
+ * @return buf, holding set as a CPU list ("0-3,8-11")
+ */
+char *cpulist_format(const cpu_set_t *set, char *buf, size_t size) {
+  size_t len = 0;
+  int i, j;
+
+  buf[0] = '\0';
+  for (i = 0; i < CPU_SETSIZE && len < size; i = j) {
+    if (!CPU_ISSET(i, set)) {
+      j = i + 1;
+      continue;
+    }
+    for (j = i + 1; j < CPU_SETSIZE && CPU_ISSET(j, set); ++j)
+      ;
+    if (j - i > 1) {
+      len += snprintf(buf + len, size - len, "%s%d-%d", len ? "," : "", i,
+                      j - 1);
+    } else {
+      len += snprintf(buf + len, size - len, "%s%d", len ? "," : "", i);
+    }
+  }
+  return buf;
+}
+
+/**
+ * @fn topology_load
+ * @brief Read the NUMA nodes and their CPUs from sysfs (once), keeping only
+ *        the CPUs the shell may run on. Without sysfs, all of them make up a
+ *        single node of unknown id
+ */
+void topology_load(void) {
+  struct topology *t = &topology;
+  char path[64], list[4096];
+  struct dirent *ent;
+  int i, j, id, fd;
+  ssize_t n;
+  DIR *dir;
+
+  if (t->loaded) {
+    return;
+  }
+  t->loaded = 1;
+  if (sched_getaffinity(0, sizeof(t->allowed), &t->allowed) == -1) {
+    CPU_ZERO(&t->allowed);
+    CPU_SET(0, &t->allowed);
+  }
+
+  dir = opendir("/sys/devices/system/node");
+  while (dir != NULL && (ent = readdir(dir)) != NULL &&
+         t->nnodes < TOPOLOGY_MAX_NODES) {
+    if (sscanf(ent->d_name, "node%d", &id) != 1) {
+      continue;
+    }
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             id);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      continue;
+    }
+    n = read(fd, list, sizeof(list) - 1);
+    close(fd);
+    list[n > 0 ? n : 0] = '\0';
+
+    // Memory only nodes, or nodes with none of the shell's CPUs, are left
+    cpu_set_t *cpus = &t->node_cpus[t->nnodes];
+    if (cpulist_parse(list, cpus) == -1) {
+      continue;
+    }
+    CPU_AND(cpus, cpus, &t->allowed);
+    if (CPU_COUNT(cpus) == 0) {
+      continue;
+    }
+
+    // Keep nodes sorted by id
+    for (i = t->nnodes; i > 0 && t->node_id[i - 1] > id; --i) {
+      t->node_id[i] = t->node_id[i - 1];
+      t->node_cpus[i] = t->node_cpus[i - 1];
+    }
+    t->node_id[i] = id;
+    t->node_cpus[i] = *cpus;
+    t->nnodes++;
+  }
+  if (dir != NULL) {
+    closedir(dir);
+  }
+  if (t->nnodes == 0) {
+    t->node_id[0] = -1;
+    t->node_cpus[0] = t->allowed;
+    t->nnodes = 1;
+  }
+
+  // CPUs one node after another, in the order segments are placed on them
+  for (i = 0; i < t->nnodes; ++i) {
+    for (j = 0; j < CPU_SETSIZE; ++j) {
+      if (CPU_ISSET(j, &t->node_cpus[i])) {
+        t->cpus[t->ncpus] = j;
+        t->cpu_node[t->ncpus++] = i;
+      }
+    }
+  }
+}
+
+/**
+ * @fn place_segment
+ * @param[in] k Index of the segment in its line
+ * @return place of the segment (index into topology.cpus), -1 for none
+ * @brief Segments take the CPUs in turn, filling a node before the next
+ */
+int place_segment(int k) {
+  if (place_policy == PLACE_NONE) {
+    return -1;
+  }
+  topology_load();
+  return k % topology.ncpus;
+}
+
+/**
+ * @fn place_enter
+ * @param[in] place
+ * @brief Move the shell to the place before launching a child there, so the
+ *        child starts out with its CPUs and memory policy (both inherited,
+ *        whichever the engine)
+ */
+void place_enter(int place) {
+  unsigned long nodes[TOPOLOGY_MAX_NODES / (8 * sizeof(long))] = {0};
+  int node = topology.cpu_node[place];
+  cpu_set_t set;
+
+  if (place_policy == PLACE_RR) {
+    CPU_ZERO(&set);
+    CPU_SET(topology.cpus[place], &set);
+    sched_setaffinity(0, sizeof(set), &set);
+  } else {
+    sched_setaffinity(0, sizeof(set), &topology.node_cpus[node]);
+  }
+  if (place_membind && topology.node_id[node] >= 0 &&
+      topology.node_id[node] < TOPOLOGY_MAX_NODES) {
+    int id = topology.node_id[node];
+    nodes[id / (8 * sizeof(long))] |= 1UL << (id % (8 * sizeof(long)));
+    syscall(SYS_set_mempolicy, MPOL_BIND, nodes, TOPOLOGY_MAX_NODES + 1);
+  }
+}
+
+/**
+ * @fn place_leave
+ * @brief Give the shell back its own CPUs and memory policy
+ */
+void place_leave(void) {
+  sched_setaffinity(0, sizeof(topology.allowed), &topology.allowed);
+  if (place_membind) {
+    syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+  }
+}
+
+/**
+ * @fn priority_parse
+ * @param[in] spec Comma separated "normal", "batch" or "idle" (CPU policy),
+ *                 "nice=<n>" and "io=normal|idle"
+ * @param[out] p Left unchanged on error
+ * @return 0 on success, -1 if spec is incorrect
+ * @brief Items not given are normal (policy, nice 0 and best-effort I/O)
+ */
+int priority_parse(const char *spec, struct priority *p) {
+  struct priority q = {SCHED_OTHER, 0, 0};
+  size_t len;
+  char *end;
+  int i;
+
+  while (*spec != '\0') {
+    len = strcspn(spec, ",");
+    for (i = 0; i < 3; ++i) {
+      if (len == strlen(sched_names[i]) &&
+          !strncmp(spec, sched_names[i], len)) {
+        break;
+      }
+    }
+    if (i < 3) {
+      q.policy = sched_policies[i];
+    } else if (!strncmp(spec, "nice=", 5) && len > 5) {
+      q.nice = strtol(spec + 5, &end, 10);
+      if (end != spec + len || q.nice < -20 || q.nice > 19) {
+        return -1;
+      }
+    } else if (len == 7 && !strncmp(spec, "io=idle", 7)) {
+      q.io_idle = 1;
+    } else if (len == 9 && !strncmp(spec, "io=normal", 9)) {
+      q.io_idle = 0;
+    } else {
+      return -1;
+    }
+    spec += spec[len] == ',' ? len + 1 : len;
+  }
+  *p = q;
+  return 0;
+}
+
+/**
+ * @fn priority_format
+ * @param[in] p
+ * @param[out] buf
+ * @param[in] size
+ * @return buf, holding p the way priority_parse reads it
+ */
+char *priority_format(const struct priority *p, char *buf, size_t size) {
+  int i;
+
+  for (i = 0; i < 3 && sched_policies[i] != p->policy; ++i)
+    ;
+  snprintf(buf, size, "%s,nice=%d,io=%s", i < 3 ? sched_names[i] : "other",
+           p->nice,
+           p->io_idle ? "idle" : "normal");
+  return buf;
+}
+
+/**
+ * @fn priority_apply
+ * @param[in] pid
+ * @param[in] p
+ * @return 0 on success, -1 on error (errno set)
+ * @brief Set the CPU policy, nice value and I/O class of the process.
+ *        Raising priority back may take privileges the shell doesn't have
+ */
+int priority_apply(int pid, const struct priority *p) {
+  struct sched_param sp = {0};
+  int io = p->io_idle ? IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)
+                      : IOPRIO_PRIO_VALUE(IOPRIO_CLASS_NONE, 0);
+
+  if (sched_setscheduler(pid, p->policy, &sp) == -1 ||
+      setpriority(PRIO_PROCESS, pid, p->nice) == -1 ||
+      syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, pid, io) == -1) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @fn priority_apply_group
+ * @param[in] pgid
+ * @param[in] p
+ * @return 0 on success, -1 on error
+ * @brief Give every process of the group the priority (a job with what it
+ *        launched, or all stages of a pipeline)
+ */
+int priority_apply_group(int pgid, const struct priority *p) {
+  struct sched_param sp = {0};
+  struct dirent *e;
+  char path[64], buf[512], *end;
+  int io = p->io_idle ? IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)
+                      : IOPRIO_PRIO_VALUE(IOPRIO_CLASS_NONE, 0);
+  int fd, pid, pgrp, ret = 0;
+  ssize_t n;
+
+  // No call sets the policy of a group, its members are found in /proc
+  DIR *dir = opendir("/proc");
+  while (dir != NULL && (e = readdir(dir)) != NULL) {
+    pid = atoi(e->d_name);
+    if (pid <= 0) {
+      continue;
+    }
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    n = fd != -1 ? read(fd, buf, sizeof(buf) - 1) : -1;
+    if (fd != -1) {
+      close(fd);
+    }
+    if (n <= 0) {
+      continue;
+    }
+    // "pid (comm) state ppid pgrp ...", comm may hold anything
+    buf[n] = '\0';
+    end = strrchr(buf, ')');
+    if (end != NULL && sscanf(end + 1, " %*c %*d %d", &pgrp) == 1 &&
+        pgrp == pgid && sched_setscheduler(pid, p->policy, &sp) == -1 &&
+        errno != ESRCH) {
+      ret = -1;
+    }
+  }
+  if (dir != NULL) {
+    closedir(dir);
+  }
+
+  if (dir == NULL || setpriority(PRIO_PGRP, pgid, p->nice) == -1 ||
+      syscall(SYS_ioprio_set, IOPRIO_WHO_PGRP, pgid, io) == -1) {
+    return -1;
+  }
+  return ret;
+}
+
+/**
+ * @fn priority_apply_job
+ * @param[in] pid Background job
+ * @param[in] p
+ * @return 0 on success, -1 on error
+ * @brief Give the job's process group the priority, or the job alone if it
+ *        couldn't get a group of its own
+ */
+int priority_apply_job(int pid, const struct priority *p) {
+  int pgid = getpgid(pid);
+
+  if (pgid == -1 || pgid == getpgrp()) {
+    return priority_apply(pid, p);
+  }
+  return priority_apply_group(pgid, p);
+}
+
+/**
+ * @fn signals_restore
+ * @brief In a child: undo what the shell changed for itself (SIGINT
+ *        handled, SIGTTOU and SIGTTIN ignored when lines get the terminal)
+ */
+void signals_restore(void) {
+  signal(SIGINT, SIG_DFL);
+  if (fg_group.tty >= 0) {
+    signal(SIGTTOU, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+  }
+}
+
+/**
+ * @fn msgs_child
+ * @brief In a child forked while the shell works on a client's line,
+ *        printf goes to stdout again
+ */
+void msgs_child(void) {
+  if (msgs.to != NULL) {
+    stdout = msgs.saved;
+    msgs.to = NULL;
+  }
+}
+
+/**
+ * @fn spawn_fork
+ * @param[in] path
+ * @param[in] tokens
+ * @param[in] pgid
+ * @param[in] fds
+ * @return child PID, -1 on error (errno set)
+ * @brief Launch the executable with fork and execve.
+ *        Exec failure is reported back through a close-on-exec pipe, so the
+ *        call returns only once the child has exec'd (or failed to)
+ */
+int spawn_fork(const char *path, char **tokens, int pgid, const int *fds) {
+  int errpipe[2], err, n, i;
+
+  if (pipe2(errpipe, O_CLOEXEC) == -1) {
+    return -1;
+  }
+
+  int ret = fork();
+  if (ret < 0) {
+    err = errno;
+    close(errpipe[0]);
+    close(errpipe[1]);
+    errno = err;
+    return -1;
+  } else if (ret == 0) {
+    // Child process
+    msgs_child();
+    close(errpipe[0]);
+    // A group whose members have all ended can't be joined, lead a new one
+    if (pgid >= 0 && setpgid(0, pgid) == -1) {
+      setpgid(0, 0);
+    }
+    signals_restore();
+    // Before exec, so what the command launches inherits the priority
+    if (spawn_priority != NULL && priority_apply(0, spawn_priority) == -1) {
+      printf("Shell: Can't change priority of %d\n", getpid());
+      fflush(stdout);
+    }
+    for (i = 0; fds != NULL && i < 3; ++i) {
+      if (fds[i] >= 0) {
+        dup2(fds[i], i);
+      }
+    }
+    execve(path, tokens, environ);
+    err = errno;
+    write(errpipe[1], &err, sizeof(err));
+    _exit(127);
+  }
+
+  // Parent process: EOF on the pipe means exec succeeded
+  close(errpipe[1]);
+  do {
+    n = read(errpipe[0], &err, sizeof(err));
+  } while (n == -1 && errno == EINTR);
+  close(errpipe[0]);
+
+  if (n == sizeof(err)) {
+    waitpid(ret, NULL, 0);
+    errno = err;
+    return -1;
+  }
+  return ret;
+}
+
+/**
+ * @fn spawn_posix
+ * @param[in] path
+ * @param[in] tokens
+ * @param[in] pgid
+ * @param[in] fds
+ * @return child PID, -1 on error (errno set)
+ * @brief Launch the executable with posix_spawn (vfork-style clone, so the
+ *        shell's page tables are never copied)
+ */
+int spawn_posix(const char *path, char **tokens, int pgid, const int *fds) {
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t dfl;
+  short flags = 0;
+  pid_t pid;
+  int err, i;
+
+  posix_spawnattr_init(&attr);
+  if (pgid >= 0) {
+    flags |= POSIX_SPAWN_SETPGROUP;
+    posix_spawnattr_setpgroup(&attr, pgid);
+  }
+  if (fg_group.tty >= 0) {
+    // Ignored by the shell only
+    sigemptyset(&dfl);
+    sigaddset(&dfl, SIGTTOU);
+    sigaddset(&dfl, SIGTTIN);
+    flags |= POSIX_SPAWN_SETSIGDEF;
+    posix_spawnattr_setsigdefault(&attr, &dfl);
+  }
+  posix_spawnattr_setflags(&attr, flags);
+  posix_spawn_file_actions_init(&actions);
+  for (i = 0; fds != NULL && i < 3; ++i) {
+    if (fds[i] >= 0) {
+      posix_spawn_file_actions_adddup2(&actions, fds[i], i);
+    }
+  }
+  err = posix_spawn(&pid, path, &actions, &attr, tokens, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+
+  if (err != 0) {
+    errno = err;
+    return -1;
+  }
+  return pid;
+}
+
+/**
+ * @fn pool_main
+ * @param[in] fd Socket to the shell
+ * @brief Pooled process: wait for a command from the shell and become it.
+ *        Exec failure is sent back, success closes the socket
+ */
+void pool_main(int fd) {
+  struct zygote_request req;
+  char cbuf[CMSG_SPACE(3 * sizeof(int))];
+  struct iovec iov = {&req, sizeof(req)};
+  struct msghdr msg;
+  struct cmsghdr *cm;
+  char *buf, *p, **argv, **env;
+  int i, err, fds[3], len = 0;
+  ssize_t n;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+  do {
+    n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+  } while (n == -1 && errno == EINTR);
+  cm = CMSG_FIRSTHDR(&msg);
+  if (n != sizeof(req) || cm == NULL ||
+      cm->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+    // The shell is gone (or never used this one)
+    _exit(0);
+  }
+  memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+
+  // Path, working directory, arguments and environment, each terminated
+  buf = (char *)malloc(req.len);
+  argv = (char **)malloc((req.argc + req.envc + 2) * sizeof(char *));
+  while (buf != NULL && argv != NULL && len < req.len &&
+         ((n = read(fd, buf + len, req.len - len)) > 0 ||
+                        (n == -1 && errno == EINTR))) {
+    len += n > 0 ? n : 0;
+  }
+  if (buf == NULL || argv == NULL || len < req.len) {
+    _exit(127);
+  }
+  env = argv + req.argc + 1;
+  p = buf + strlen(buf) + 1;
+  err = chdir(p) == -1 ? errno : 0;
+  p += strlen(p) + 1;
+  for (i = 0; i < req.argc + req.envc; ++i) {
+    argv[i < req.argc ? i : i + 1] = p;
+    p += strlen(p) + 1;
+  }
+  argv[req.argc] = NULL;
+  env[req.envc] = NULL;
+
+  if (setpgid(0, req.pgid) == -1) {
+    setpgid(0, 0);
+  }
+  for (i = 0; i < 3; ++i) {
+    dup2(fds[i], i);
+  }
+  signals_restore();
+  if (err == 0) {
+    execve(buf, argv, env);
+    err = errno;
+  }
+  write(fd, &err, sizeof(err));
+  _exit(127);
+}
+
+/**
+ * @fn zygote_main
+ * @param[in] fd Socket to the shell
+ * @brief Zygote: keep ZYGOTE_POOL processes waiting for commands, creating
+ *        one more each time the shell asks. They are cloned with
+ *        CLONE_PARENT, so they are children of the shell (which reaps them)
+ */
+void zygote_main(int fd) {
+  char cbuf[CMSG_SPACE(sizeof(int))], byte;
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr *cm;
+  int pid, sp[2], want = ZYGOTE_POOL;
+  ssize_t n;
+
+  while (1) {
+    for (; want > 0; --want) {
+      if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sp) == -1) {
+        break;
+      }
+      pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, NULL, NULL, 0);
+      if (pid == 0) {
+        close(fd);
+        close(sp[0]);
+        pool_main(sp[1]);
+      }
+      close(sp[1]);
+      if (pid > 0) {
+        // Its PID, and the end of the socket the shell talks to it through
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = &pid;
+        iov.iov_len = sizeof(pid);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cm), &sp[0], sizeof(int));
+        sendmsg(fd, &msg, MSG_NOSIGNAL);
+      }
+      close(sp[0]);
+    }
+
+    n = read(fd, &byte, 1);
+    if (n == 0 || (n == -1 && errno != EINTR)) {
+      _exit(0);
+    }
+    want += n > 0;
+  }
+}
+
+/**
+ * @fn zygote_start
+ * @return 0 on success, -1 on error
+ * @brief Fork the zygote (best while the shell is still small, so this
+ *        fork is the one paying for its page tables)
+ */
+int zygote_start(void) {
+  int sv[2];
+
+  if (zygote.pid > 0) {
+    return 0;
+  }
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+    return -1;
+  }
+  fflush(stdout);
+  zygote.pid = fork();
+  if (zygote.pid == 0) {
+    // Out of the terminal's way (Ctrl-C), holding nothing of the shell
+    setpgid(0, 0);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    dup3(sv[1], 3, O_CLOEXEC);
+    close_range(4, ~0U, 0);
+    zygote_main(3);
+  }
+  close(sv[1]);
+  if (zygote.pid < 0) {
+    close(sv[0]);
+    return -1;
+  }
+  zygote.fd = sv[0];
+  return 0;
+}
+
+/**
+ * @fn zygote_collect
+ * @brief Take the pooled processes the zygote has sent so far
+ */
+void zygote_collect(void) {
+  char cbuf[CMSG_SPACE(sizeof(int))];
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr *cm;
+  int pid;
+
+  while (zygote.nready < ZYGOTE_POOL) {
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &pid;
+    iov.iov_len = sizeof(pid);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    if (recvmsg(zygote.fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC) !=
+        sizeof(pid)) {
+      return;
+    }
+    cm = CMSG_FIRSTHDR(&msg);
+    if (cm != NULL && cm->cmsg_len == CMSG_LEN(sizeof(int))) {
+      memcpy(&zygote.ready_fd[zygote.nready], CMSG_DATA(cm), sizeof(int));
+      zygote.ready_pid[zygote.nready++] = pid;
+    }
+  }
+}
+
+/**
+ * @fn spawn_zygote
+ * @param[in] path
+ * @param[in] tokens
+ * @param[in] pgid
+ * @param[in] fds
+ * @return child PID, -1 on error (errno set)
+ * @brief Launch the executable through a process pre-forked by the zygote:
+ *        hand it the command, directory, environment and descriptors, and
+ *        have the zygote make another one. Without any ready, fall back to
+ *        posix_spawn
+ */
+int spawn_zygote(const char *path, char **tokens, int pgid, const int *fds) {
+  char cbuf[CMSG_SPACE(3 * sizeof(int))], cwd[PATH_MAX];
+  struct zygote_request req;
+  struct iovec iov[2];
+  struct msghdr msg;
+  struct cmsghdr *cm;
+  int i, k, pid, fd, err, send_fds[3];
+  size_t len, off;
+  ssize_t n;
+  char *buf;
+
+  if (zygote.nready == 0) {
+    zygote_collect();
+  }
+  if (zygote.nready == 0 || getcwd(cwd, sizeof(cwd)) == NULL) {
+    zygote.fallbacks++;
+    return spawn_posix(path, tokens, pgid, fds);
+  }
+  pid = zygote.ready_pid[--zygote.nready];
+  fd = zygote.ready_fd[zygote.nready];
+  send(zygote.fd, "", 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+  // Everything in one buffer, each string with its terminator
+  req.pgid = pgid < 0 ? getpgrp() : pgid;
+  len = strlen(path) + strlen(cwd) + 2;
+  for (req.argc = 0; tokens[req.argc] != NULL; ++req.argc) {
+    len += strlen(tokens[req.argc]) + 1;
+  }
+  for (req.envc = 0; environ[req.envc] != NULL; ++req.envc) {
+    len += strlen(environ[req.envc]) + 1;
+  }
+  req.len = len;
+  buf = (char *)malloc(len);
+  if (buf == NULL) {
+    close(fd);
+    errno = ENOMEM;
+    return -1;
+  }
+  off = 0;
+  for (i = -2; i < req.argc + req.envc; ++i) {
+    const char *s = i == -2   ? path
+                    : i == -1 ? cwd
+                    : i < req.argc ? tokens[i]
+                                   : environ[i - req.argc];
+    k = strlen(s) + 1;
+    memcpy(buf + off, s, k);
+    off += k;
+  }
+  for (i = 0; i < 3; ++i) {
+    send_fds[i] = fds != NULL && fds[i] >= 0 ? fds[i] : i;
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  iov[0].iov_base = &req;
+  iov[0].iov_len = sizeof(req);
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+  cm = CMSG_FIRSTHDR(&msg);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(sizeof(send_fds));
+  memcpy(CMSG_DATA(cm), send_fds, sizeof(send_fds));
+  n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+  for (off = 0; n == sizeof(req) && off < len; off += n > 0 ? n : 0) {
+    n = send(fd, buf + off, len - off, MSG_NOSIGNAL);
+    if (n == -1 && errno == EINTR) {
+      n = 0;
+    } else if (n == -1) {
+      break;
+    }
+  }
+  free(buf);
+
+  // EOF once it has exec'd, an errno if it couldn't
+  if (n >= 0) {
+    do {
+      n = read(fd, &err, sizeof(err));
+    } while (n == -1 && errno == EINTR);
+  }
+  close(fd);
+  if (n == 0) {
+    return pid;
+  }
+  errno = n == sizeof(err) ? err : EAGAIN;
+  return -1;
+}
+
+/**
+ * @fn spawn
+ * @param[in] tokens
+ * @param[in] pgid Process group to join (0 for a new one, -1 to inherit)
+ * @param[in] fds Descriptors for stdin, stdout and stderr (NULL or -1 to
+ *                inherit)
+ * @return child PID, -1 on error
+ * @brief Launch the executable with the selected engine and record how long
+ *        the launch took
+ */
+int spawn(char **tokens, int pgid, const int *fds) {
+  const char *path;
+  long start;
+  int ret, retry = 1, engine = spawn_mode;
+
+  // A priority is set in the child before exec, which only fork can do
+  // (posix_spawn can't set a nice value). Pre-forked processes can't take
+  // the shell's placement
+  if (spawn_priority != NULL) {
+    engine = SPAWN_FORK;
+  } else if (engine == SPAWN_ZYGOTE && spawn_place >= 0) {
+    engine = SPAWN_POSIX;
+  }
+
+  // Keep the shell's output ordered before the child's
+  fflush(stdout);
+  start = now_ns();
+  if (spawn_place >= 0) {
+    place_enter(spawn_place);
+  }
+
+  while (1) {
+    path = hash_lookup(tokens[0]);
+    if (path == NULL) {
+      errno = ENOENT;
+      ret = -1;
+    } else if (engine == SPAWN_FORK) {
+      ret = spawn_fork(path, tokens, pgid, fds);
+    } else if (engine == SPAWN_ZYGOTE) {
+      ret = spawn_zygote(path, tokens, pgid, fds);
+    } else {
+      ret = spawn_posix(path, tokens, pgid, fds);
+    }
+
+    // A group whose leader is already gone can't be joined, start a new one
+    if (ret < 0 && errno == EPERM && pgid > 0) {
+      pgid = 0;
+      continue;
+    }
+    // The executable moved since it was hashed, look it up again
+    if (ret < 0 && errno == ENOENT && path != NULL && path != tokens[0] &&
+        retry) {
+      hash_forget(tokens[0]);
+      retry = 0;
+      continue;
+    }
+    break;
+  }
+  if (spawn_place >= 0) {
+    place_leave();
+  }
+
+  if (ret < 0) {
+    TRACE(TRACE_PROC, "exec-fail",
+          "\"engine\":\"%s\",\"errno\":%d,\"latency_ns\":%ld,\"cmd\":\"%s\"",
+          spawn_names[engine], errno, now_ns() - start,
+          trace_str(tokens[0]));
+    stats.exec_failures++;
+    if (errno == EAGAIN || errno == ENOMEM) {
+      printf("Shell: Error while calling %s\n", spawn_names[engine]);
+    } else {
+      printf("Shell: Incorrect command\n");
+    }
+    return -1;
+  }
+
+  // Update latency statistics of the engine used
+  long elapsed = now_ns() - start;
+  hist_record(&stats.spawn[engine], elapsed);
+
+  // The child is in the shell's group (-1), its own (0), or in pgid
+  TRACE(TRACE_PROC, "spawn",
+        "\"pid\":%d,\"pgid\":%d,\"engine\":\"%s\",\"latency_ns\":%ld,"
+        "\"cmd\":\"%s\"",
+        ret, pgid < 0 ? getpgrp() : pgid > 0 ? pgid : ret,
+        spawn_names[engine], elapsed, trace_str(tokens[0]));
+  return ret;
+}
+
+/**
+ * @fn builtin_spawnstat
+ * @param[in] tokens
+ * @param[in] c
+ * @return exit code
+ * @brief Print launch latency of each engine ("spawnstat reset" clears it)
+ */
+int builtin_spawnstat(char **tokens, struct chain *c) {
+  int i;
+
+  if (tokens[1] != NULL && (strcmp(tokens[1], "reset") || tokens[2] != NULL)) {
+    printf("Shell: Incorrect command\n");
+    return 1;
+  }
+  if (tokens[1] != NULL) {
+    memset(stats.spawn, 0, sizeof(stats.spawn));
+    zygote.fallbacks = 0;
+    return 0;
+  }
+
+  printf("%-6s %8s %10s %10s %10s\n", "engine", "count", "avg(us)", "min(us)",
+         "max(us)");
+  for (i = 0; i < 3; ++i) {
+    struct histogram *h = &stats.spawn[i];
+    printf("%-6s%c%8ld %10.1f %10.1f %10.1f\n", spawn_names[i],
+           i == spawn_mode ? '*' : ' ', h->count,
+           h->count ? h->sum / 1e3 / h->count : 0.0, h->min / 1e3,
+           h->max / 1e3);
+  }
+  if (zygote.fallbacks > 0) {
+    printf("zygote fell back to posix %ld times\n", zygote.fallbacks);
+  }
+  return 0;
+}
+
+/**
+ * @fn builtin_stats
+ * @param[in] tokens
+ * @param[in] c
+ * @return exit code
+ * @brief Print the shell's counters and latency histograms as a table, or
+ *        as JSON lines with their buckets ("stats -J"). "stats reset"
+ *        clears them
+ */
+int builtin_stats(char **tokens, struct chain *c) {
+  static const char *names[] = {"spawn-fork", "spawn-posix", "spawn-zygote",
+                                "fork-builtin", "runtime",  "reap",
+                                "queue",        "width"};
+  struct histogram *hists[] = {&stats.spawn[0], &stats.spawn[1],
+                               &stats.spawn[2], &stats.fork,
+                               &stats.runtime,  &stats.reap,
+                               &stats.queue,    &stats.width};
+  static const double quantiles[] = {0.5, 0.9, 0.99};
+  int i, json = 0, first;
+  size_t k;
+
+  if (tokens[1] != NULL && tokens[2] == NULL && !strcmp(tokens[1], "reset")) {
+    memset(&stats, 0, sizeof(stats));
+    zygote.fallbacks = 0;
+    return 0;
+  } else if (tokens[1] != NULL && tokens[2] == NULL &&
+             !strcmp(tokens[1], "-J")) {
+    json = 1;
+  } else if (tokens[1] != NULL) {
+    printf("Shell: Incorrect command\n");
+    return 1;
+  }
+
+  if (!json) {
+    printf("%-13s %8s %10s %10s %10s %10s %10s\n", "metric", "count", "avg",
+           "p50", "p90", "p99", "max");
+  }
+  for (k = 0; k < sizeof(names) / sizeof(names[0]); ++k) {
+    const struct histogram *h = hists[k];
+    // Latencies in microseconds in the table, width as is
+    double scale = h == &stats.width ? 1 : 1e3;
+
+    if (json) {
+      printf("{\"metric\":\"%s\",\"unit\":\"%s\",\"count\":%ld,"
+             "\"sum\":%ld,\"min\":%ld,\"max\":%ld",
+             names[k], h == &stats.width ? "segments" : "ns", h->count,
+             h->sum, h->min, h->max);
+      printf(",\"p50\":%ld,\"p90\":%ld,\"p99\":%ld,\"buckets\":[",
+             hist_percentile(h, 0.5), hist_percentile(h, 0.9),
+             hist_percentile(h, 0.99));
+      // Non-empty buckets as [lowest value, count]
+      for (i = 0, first = 1; i < HIST_BUCKETS; ++i) {
+        if (h->buckets[i] > 0) {
+          printf("%s[%ld,%ld]", first ? "" : ",", hist_lowest(i),
+                 h->buckets[i]);
+          first = 0;
+        }
+      }
+      printf("]}\n");
+      continue;
+    }
+    printf("%-13s %8ld %10.1f", names[k], h->count,
+           h->count ? h->sum / scale / h->count : 0.0);
+    for (i = 0; i < 3; ++i) {
+      printf(" %10.1f", h->count ? hist_percentile(h, quantiles[i]) / scale
+                                 : 0.0);
+    }
+    printf(" %10.1f\n", h->max / scale);
+  }
+
+  if (json) {
+    printf("{\"metric\":\"exec-fail\",\"count\":%ld}\n",
+           stats.exec_failures);
+    printf("{\"metric\":\"zygote-fallback\",\"count\":%ld}\n",
+           zygote.fallbacks);
+  } else {
+    printf("latencies in us, width in segments; %ld exec failures, "
+           "%ld zygote fallbacks\n",
+           stats.exec_failures, zygote.fallbacks);
+  }
+  return 0;
+}
+
+/**
+ * @fn parse_duration
+ * @param[in] arg Number with an optional suffix (ms, s, m, h, d)
+ * @param[out] ns
+ * @return 0 on success, -1 if arg isn't a duration
+ */
+int parse_duration(const char *arg, long *ns) {
+  char *end;
+  double secs = strtod(arg, &end);
+
+  if (end == arg || secs < 0) {
+    return -1;
+  }
+  if (!strcmp(end, "ms")) {
+    secs /= 1e3;
+  } else if (!strcmp(end, "m")) {
+    secs *= 60;
+  } else if (!strcmp(end, "h")) {
+    secs *= 3600;
+  } else if (!strcmp(end, "d")) {
+    secs *= 86400;
+  } else if (*end != '\0' && strcmp(end, "s")) {
+    return -1;
+  }
+  *ns = secs * 1e9;
+  return 0;
+}
+
+/**
+ * @fn set_option
+ * @param[in] name
+ * @param[in] value
+ * @return 0 on success, -1 on unknown option or value
+ * @brief Change a runtime option of the shell
+ */
+int set_option(const char *name, const char *value) {
+  int i;
+
+  if (!strcmp(name, "spawn")) {
+    for (i = 0; i < 3; ++i) {
+      if (!strcmp(value, spawn_names[i])) {
+        // The zygote is forked the first time it is chosen
+        if (i == SPAWN_ZYGOTE && zygote_start() == -1) {
+          return -1;
+        }
+        spawn_mode = i;
+        return 0;
+      }
+    }
+  } else if (!strcmp(name, "jobs")) {
+    char *end;
+    long jobs = strtol(value, &end, 10);
+    if (*end == '\0' && jobs > 0 && jobs <= (1 << 20)) {
+      max_jobs = jobs;
+      return 0;
+    }
+  } else if (!strcmp(name, "placement")) {
+    for (i = 0; i < 3; ++i) {
+      if (!strcmp(value, place_names[i])) {
+        place_policy = i;
+        return 0;
+      }
+    }
+  } else if (!strcmp(name, "membind")) {
+    if (!strcmp(value, "on") || !strcmp(value, "off")) {
+      place_membind = !strcmp(value, "on");
+      return 0;
+    }
+  } else if (!strcmp(name, "bg-priority")) {
+    return priority_parse(value, &bg_priority);
+  } else if (!strcmp(name, "deadline")) {
+    return parse_duration(value, &deadline_ns);
+  } else if (!strcmp(name, "output")) {
+    for (i = 0; i < 3; ++i) {
+      if (!strcmp(value, output_names[i])) {
+        output_mode = i;
+        return 0;
+      }
+    }
+  } else if (!strcmp(name, "history")) {
+    if (!strcmp(value, "on") || !strcmp(value, "off")) {
+      history.record = !strcmp(value, "on");
+      return 0;
+    }
+  } else if (!strcmp(name, "pipe-size")) {
+    char *end;
+    long size = strtol(value, &end, 10);
+    if (*end == '\0' && size >= 0 && size <= (1 << 30)) {
+      pipe_size = size;
+      return 0;
+    }
+#ifdef SHELL_TRACE
+  } else if (!strcmp(name, "trace")) {
+    char *end;
+    long level = strtol(value, &end, 10);
+    if (*end == '\0' && level >= 0 && level <= TRACE_CMD) {
+      trace_level = level;
+      return 0;
+    }
+  } else if (!strcmp(name, "trace-file")) {
+    int fd = open(value, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd != -1) {
+      // Events so far go where they were meant to
+      trace_flush();
+      if (trace_ring.fd != STDERR_FILENO) {
+        close(trace_ring.fd);
+      }
+      trace_ring.fd = fd;
+      return 0;
+    }
+#endif
+  }
+  return -1;
+}
+
+/**
+ * @fn builtin_set
+ * @param[in] tokens
+ * @param[in] c
+ * @return exit code
+ * @brief "set" lists the runtime options, "set <name> <value>" changes one
+ */
+int builtin_set(char **tokens, struct chain *c) {
+  char spec[64];
+
+  if (tokens[1] == NULL) {
+    printf("spawn %s\n", spawn_names[spawn_mode]);
+    printf("jobs %d\n", max_jobs);
+    printf("pipe-size %d\n", pipe_size);
+    printf("history %s\n", history.record ? "on" : "off");
+    printf("output %s\n", output_names[output_mode]);
+    printf("placement %s\n", place_names[place_policy]);
+    printf("membind %s\n", place_membind ? "on" : "off");
+    printf("deadline %.3fs\n", deadline_ns / 1e9);
+    printf("bg-priority %s\n",
+           priority_format(&bg_priority, spec, sizeof(spec)));
+#ifdef SHELL_TRACE
+    printf("trace %d\n", trace_level);
+#endif
+  } else if (tokens[2] == NULL || tokens[3] != NULL ||
+             set_option(tokens[1], tokens[2]) == -1) {
+    printf("Shell: Incorrect command\n");
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * @fn exit_code
+ * @param[in] status
+ * @return exit code of the child (128 + signal number if it was killed)
+ */
+int exit_code(int status) {
+  if (WIFSIGNALED(status)) {
+    return 128 + WTERMSIG(status);
+  }
+  return WEXITSTATUS(status);
+}
+
+void chain_advance(struct chain *c);
+void chain_proc_done(struct proc *p);
+
+/**
+ * @fn line_signal
+ * @param[in] g
+ * @param[in] sig
+ * @param[in] group 0 if the line's group already got sig (from the
+ *                  terminal)
+ * @brief Signal the whole process group of the line at once, and the
+ *        foreground children outside of it: the groups of timed commands
+ *        through their leader, those that couldn't join one by themselves
+ */
+void line_signal(struct line_group *g, int sig, int group) {
+  struct proc *p;
+  size_t i;
+
+  TRACE(TRACE_PROC, "cancel", "\"pgid\":%d,\"signal\":%d", g->pgid, sig);
+  if (group && g->pgid > 0) {
+    killpg(g->pgid, sig);
+  }
+  for (i = 0; i < procs.nbuckets; ++i) {
+    for (p = procs.buckets[i]; p != NULL; p = p->next) {
+      struct chain *pc = (struct chain *)p->data;
+      if (p->on_exit != chain_proc_done || p->done || pc->group != g ||
+          getpgid(p->pid) == g->pgid) {
+        continue;
+      }
+      if (pc->own_group && p->pid == pc->pgid) {
+        killpg(pc->pgid, sig);
+      } else {
+        kill(p->pid, sig);
+      }
+    }
+  }
+}
+
+/**
+ * @fn on_line_kill
+ * @param[in] src
+ * @param[in] events
+ * @brief Event handler of the kill timer: the line was cancelled
+ *        KILL_GRACE_MS ago, what is left of it gets SIGKILL
+ */
+void on_line_kill(struct event_source *src, unsigned events) {
+  struct line_group *g = (struct line_group *)src->data;
+  uint64_t ticks;
+
+  read(src->fd, &ticks, sizeof(ticks));
+  g->killed = 1;
+  line_signal(g, SIGKILL, 1);
+}
+
+/**
+ * @fn line_stop
+ * @param[in] g
+ * @brief Nothing else of the line starts. For the terminal's line, nothing
+ *        else of the shell's work either (interrupt)
+ */
+void line_stop(struct line_group *g) {
+  g->stopped = 1;
+  if (g == &fg_group) {
+    interrupt = 1;
+  }
+}
+
+/**
+ * @fn line_cancel
+ * @param[in] g
+ * @param[in] sig Signal for the line's processes, 0 if they already got it
+ *                (from the terminal)
+ * @brief Stop the line: nothing else of it starts, its processes get sig
+ *        and SIGKILL KILL_GRACE_MS later if they are still running
+ */
+void line_cancel(struct line_group *g, int sig) {
+  struct itimerspec its;
+
+  line_stop(g);
+  if (!g->active || g->cancel_ns > 0) {
+    return;
+  }
+  g->cancel_ns = now_ns();
+  if (sig != 0) {
+    line_signal(g, sig, 1);
+  } else {
+    // Timed commands have their own group, out of the terminal's reach
+    line_signal(g, SIGINT, 0);
+    if (g->tty >= 0) {
+      // Below the ^C, like handle_sig
+      printf("\n");
+    }
+  }
+
+  if (g->kill_timer.fd == -1) {
+    g->kill_timer.fd =
+        timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (g->kill_timer.fd == -1) {
+      printf("Shell: Error while calling timerfd_create\n");
+      return;
+    }
+    g->kill_timer.handler = on_line_kill;
+    g->kill_timer.data = g;
+    event_add(&g->kill_timer, EPOLLIN);
+  }
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = KILL_GRACE_MS / 1000;
+  its.it_value.tv_nsec = KILL_GRACE_MS % 1000 * 1000000L;
+  timerfd_settime(g->kill_timer.fd, 0, &its, NULL);
+}
+
+/**
+ * @fn line_pgid
+ * @param[in] g
+ * @return process group for a foreground child to join (0 for a new one,
+ *         -1 to stay in the shell's when no line runs)
+ */
+int line_pgid(struct line_group *g) {
+  return g->active ? g->pgid : -1;
+}
+
+/**
+ * @fn line_join
+ * @param[in] g
+ * @param[in] pid Foreground child just launched
+ * @brief Make sure the child is in the line's group (set here as well, a
+ *        forked child may not have run yet). The first child, or one that
+ *        couldn't join as every member had ended, leads a new group, which
+ *        is handed the terminal
+ */
+void line_join(struct line_group *g, int pid) {
+  if (!g->active) {
+    return;
+  }
+  if (g->pgid == 0 || setpgid(pid, g->pgid) == -1) {
+    setpgid(pid, pid);
+  }
+  g->members++;
+  if (getpgid(pid) == pid) {
+    g->pgid = pid;
+    if (g->tty >= 0) {
+      tcsetpgrp(g->tty, pid);
+    }
+  }
+}
+
+/**
+ * @fn line_begin
+ * @param[in] g
+ * @brief Foreground children launched from now on share a process group
+ */
+void line_begin(struct line_group *g) {
+  g->active = 1;
+  g->pgid = 0;
+  g->members = 0;
+  g->cancel_ns = 0;
+  g->reaped = 0;
+  g->killed = 0;
+  g->stopped = 0;
+}
+
+/**
+ * @fn line_end
+ * @param[in] g
+ * @brief Once the line's children are reaped: if it was cancelled, report.
+ *        The terminal's line first waits for the rest of its group
+ *        (processes the shell isn't the parent of), up to KILL_GRACE_MS
+ *        after SIGKILL, then the terminal goes back to the shell
+ */
+void line_end(struct line_group *g) {
+  struct itimerspec its;
+  long limit = g->cancel_ns + 2L * KILL_GRACE_MS * 1000000L;
+  int alive;
+
+  if (g->cancel_ns > 0 && g->pgid > 0) {
+    while ((alive = killpg(g->pgid, 0) == 0 || errno == EPERM) &&
+           g == &fg_group && now_ns() < limit) {
+      wait_events(LINE_POLL_MS);
+    }
+    if (alive) {
+      printf("Shell: Processes of the line still running after %.3fs\n",
+             (now_ns() - g->cancel_ns) / 1e9);
+    } else {
+      printf("Shell: Line interrupted, %d children reaped in %.3fs%s\n",
+             g->reaped, (now_ns() - g->cancel_ns) / 1e9,
+             g->killed ? " (killed)" : "");
+    }
+  }
+  if (g->cancel_ns > 0 && g->kill_timer.fd != -1) {
+    memset(&its, 0, sizeof(its));
+    timerfd_settime(g->kill_timer.fd, 0, &its, NULL);
+  }
+  if (g->tty >= 0 && g->pgid > 0) {
+    tcsetpgrp(g->tty, getpgrp());
+  }
+  g->active = 0;
+}
+
+/**
+ * @fn chain_proc_done
+ * @param[in] p
+ * @brief on_exit of a chain's child: the chain moves on once all children
+ *        of its current command have ended
+ */
+void chain_proc_done(struct proc *p) {
+  struct chain *c = (struct chain *)p->data;
+  struct line_group *g = c->group;
+
+  if (p->pid == c->last_pid) {
+    c->status = exit_code(p->status);
+  }
+  if (g->active) {
+    // Ctrl-C went to the terminal line's group, which has the terminal
+    if (g == &fg_group && WIFSIGNALED(p->status) &&
+        WTERMSIG(p->status) == SIGINT) {
+      line_cancel(g, 0);
+    }
+    g->reaped += g->cancel_ns > 0;
+
+    // Builtins run in the shell until the next child, Ctrl-C must reach
+    // the shell meanwhile. A cancelled line keeps its group to wait for.
+    // Timed commands have a group of their own
+    if (!c->own_group && --g->members == 0 && g->tty >= 0 && g->pgid > 0) {
+      tcsetpgrp(g->tty, getpgrp());
+      if (g->cancel_ns == 0) {
+        g->pgid = 0;
+      }
+    }
+  }
+  proc_remove(p);
+  if (--c->pending == 0) {
+    chain_advance(c);
+  }
+}
+
+/**
+ * @fn chain_track
+ * @param[in] c
+ * @param[in] pid
+ * @brief Make the child part of the chain's current command.
+ *        The command's exit status is that of the last child tracked
+ */
+void chain_track(struct chain *c, int pid) {
+  struct proc *p = proc_add(pid, 0);
+
+  p->on_exit = chain_proc_done;
+  p->data = c;
+  p->timing = c->cmd_timing != NULL ? c->cmd_timing : c->timing;
+  p->place = c->place;
+  c->pending++;
+  c->last_pid = pid;
+  if (c->own_group) {
+    // Set here as well, a forked child may not have run yet
+    setpgid(pid, c->pgid > 0 ? c->pgid : pid);
+    if (c->pgid == 0) {
+      c->pgid = pid;
+    }
+  } else {
+    line_join(c->group, pid);
+  }
+}
+
+/**
+ * @fn chain_pgid
+ * @param[in] c
+ * @return process group for the chain's next child (see line_pgid)
+ */
+int chain_pgid(struct chain *c) {
+  return c->own_group ? c->pgid : line_pgid(c->group);
+}
+
+/**
+ * @fn splice_out
+ * @param[in] in Pipe to take data from
+ * @param[in] out
+ * @param[in] len
+ * @return 0 on success, -1 on error
+ * @brief Move len bytes from the pipe in to out with splice, without copying
+ *        through user space. Falls back to read and write when out can't be
+ *        spliced to (e.g. a terminal)
+ */
+int splice_out(int in, int out, size_t len) {
+  static char buf[COPY_BUFFER_SIZE];
+  ssize_t n, w;
+
+  while (len > 0) {
+    n = splice(in, NULL, out, NULL, len, SPLICE_F_MOVE);
+    if (n == -1 && errno == EINVAL) {
+      n = read(in, buf, len < sizeof(buf) ? len : sizeof(buf));
+      for (w = 0; n > 0 && w < n;) {
+        ssize_t k = write(out, buf + w, n - w);
+        if (k <= 0) {
+          return -1;
+        }
+        w += k;
+      }
+    }
+    if (n <= 0) {
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    len -= n;
+  }
+  return 0;
+}
+
+/**
+ * @fn tee_copy
+ * @param[in] file
+ * @return exit code
+ * @brief Copy stdin to stdout (and file) through a buffer
+ */
+int tee_copy(int file) {
+  static char buf[COPY_BUFFER_SIZE];
+  ssize_t n;
+
+  while ((n = read(STDIN_FILENO, buf, sizeof(buf))) > 0) {
+    if (write(STDOUT_FILENO, buf, n) != n ||
+        (file >= 0 && write(file, buf, n) != n)) {
+      return 1;
+    }
+  }
+  return n == 0 ? 0 : 1;
+}
+
+/**
+ * @fn tee_stage
+ * @param[in] tokens
+ * @param[in] c
+ * @return exit code
+ * @brief Builtin "tee [-a] [file]" for pipelines: copy stdin to stdout and
+ *        file. Data is duplicated between pipes with tee and moved to the
+ *        file with splice, so it never passes through user space
+ */
+int tee_stage(char **tokens, struct chain *c) {
+  int file = -1, flags = O_TRUNC, copy[2] = {-1, -1};
+  char **args = tokens + 1;
+  struct stat in_st, out_st;
+  ssize_t n;
+
+  if (*args != NULL && !strcmp(*args, "-a")) {
+    flags = O_APPEND;
+    ++args;
+  }
+  if (*args != NULL && args[1] != NULL) {
+    printf("Shell: Incorrect command\n");
+    return 1;
+  }
+  if (*args != NULL) {
+    file = open(*args, O_WRONLY | O_CREAT | O_CLOEXEC | flags, 0666);
+    if (file == -1) {
+      printf("Shell: Can't open %s\n", *args);
+      return 1;
+    }
+  }
+
+  // Nothing to tee from
+  fstat(STDIN_FILENO, &in_st);
+  fstat(STDOUT_FILENO, &out_st);
+  if (!S_ISFIFO(in_st.st_mode)) {
+    return tee_copy(file);
+  }
+
+  // tee only duplicates into a pipe, so go through one if stdout isn't
+  int dup_to = STDOUT_FILENO;
+  if (file >= 0 && !S_ISFIFO(out_st.st_mode)) {
+    if (pipe2(copy, O_CLOEXEC) == -1) {
+      return 1;
+    }
+    dup_to = copy[1];
+  }
+
+  while (1) {
+    if (file >= 0) {
+      n = tee(STDIN_FILENO, dup_to, SPLICE_CHUNK, 0);
+    } else {
+      n = splice(STDIN_FILENO, NULL, STDOUT_FILENO, NULL, SPLICE_CHUNK,
+                 SPLICE_F_MOVE);
+    }
+    if (n == -1 && errno == EINTR) {
+      continue;
+    } else if (n == -1 && errno == EINVAL) {
+      // stdout can't be spliced to, nothing was consumed yet
+      return tee_copy(file);
+    } else if (n <= 0) {
+      return n == 0 ? 0 : 1;
+    }
+
+    if (file >= 0) {
+      // The duplicate went to stdout (or copy), consume the original
+      if (splice_out(STDIN_FILENO, file, n) == -1 ||
+          (copy[0] >= 0 && splice_out(copy[0], STDOUT_FILENO, n) == -1)) {
+        return 1;
+      }
+    }
+  }
+}
+
+/**
+ * @fn copy_fd
+ * @param[in] in
+ * @param[in] out
+ * @return 0 on success, -1 on error
+ * @brief Copy in to out until EOF, inside the kernel when the descriptors
+ *        allow it: copy_file_range between files, sendfile from a file,
+ *        splice from a pipe, read and write otherwise
+ */
+int copy_fd(int in, int out) {
+  static char buf[COPY_BUFFER_SIZE];
+  struct stat in_st, out_st;
+  ssize_t n, w;
+
+  if (fstat(in, &in_st) == -1 || fstat(out, &out_st) == -1) {
+    return -1;
+  }
+
+  // Each fast path leaves the file offsets where it stopped, so the next
+  // one can pick up from there
+  if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode)) {
+    do {
+      n = copy_file_range(in, NULL, out, NULL, SPLICE_CHUNK, 0);
+    } while (n > 0 || (n == -1 && errno == EINTR));
+    if (n == 0) {
+      return 0;
+    }
+    // Across file systems, or out opened with O_APPEND
+    if (errno != EXDEV && errno != EINVAL && errno != EBADF &&
+        errno != ENOSYS && errno != EOPNOTSUPP) {
+      return -1;
+    }
+  }
+  if (S_ISREG(in_st.st_mode)) {
+    do {
+      n = sendfile(out, in, NULL, SPLICE_CHUNK);
+    } while (n > 0 || (n == -1 && errno == EINTR));
+    if (n == 0) {
+      return 0;
+    }
+    if (errno != EINVAL && errno != ENOSYS) {
+      return -1;
+    }
+  } else if (S_ISFIFO(in_st.st_mode)) {
+    do {
+      n = splice(in, NULL, out, NULL, SPLICE_CHUNK, SPLICE_F_MOVE);
+    } while (n > 0 || (n == -1 && errno == EINTR));
+    if (n == 0) {
+      return 0;
+    }
+    if (errno != EINVAL) {
+      return -1;
+    }
+  }
+
+  while ((n = read(in, buf, sizeof(buf))) != 0) {
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    for (w = 0; w < n;) {
+      ssize_t k = write(out, buf + w, n - w);
+      if (k <= 0) {
+        return -1;
+      }
+      w += k;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @fn builtin_cat
+ * @param[in] tokens
+ * @param[in] c
+ * @return exit code
+ * @brief "cat [file...]": copy the files ("-" or none for stdin) to stdout
+ *        with copy_fd
+ */
+int builtin_cat(char **tokens, struct chain *c) {
+  int i, fd, ret = 0;
+
+  fflush(stdout);
+  if (tokens[1] == NULL) {
+    return copy_fd(STDIN_FILENO, STDOUT_FILENO) == 0 ? 0 : 1;
+  }
+  for (i = 1; tokens[i] != NULL; ++i) {
+    if (!strcmp(tokens[i], "-")) {
+      fd = STDIN_FILENO;
+    } else if ((fd = open(tokens[i], O_RDONLY | O_CLOEXEC)) == -1) {
+      printf("Shell: Can't open %s\n", tokens[i]);
+      fflush(stdout);
+      ret = 1;
+      continue;
+    }
+    if (copy_fd(fd, STDOUT_FILENO) == -1) {
+      ret = 1;
+    }
+    if (fd != STDIN_FILENO) {
+      close(fd);
+    }
+  }
+  return ret;
+}
+
+/**
+ * @fn builtin_cp
+ * @param[in] tokens
+ * @param[in] c
+ * @return exit code
+ * @brief "cp source target": copy a file (into target if it's a directory)
+ *        with copy_fd
+ */
+int builtin_cp(char **tokens, struct chain *c) {
+  struct stat src_st, dst_st;
+  const char *dst;
+  char *path = NULL;
+  int in, out, ret;
+
+  if (tokens[1] == NULL || tokens[2] == NULL || tokens[3] != NULL) {
+    printf("Shell: Incorrect command\n");
+    return 1;
+  }
+  in = open(tokens[1], O_RDONLY | O_CLOEXEC);
+  if (in == -1 || fstat(in, &src_st) == -1 || S_ISDIR(src_st.st_mode)) {
+    printf("Shell: Can't open %s\n", tokens[1]);
+    if (in != -1) {
+      close(in);
+    }
+    return 1;
+  }
+
+  dst = tokens[2];
+  if (stat(dst, &dst_st) == 0 && S_ISDIR(dst_st.st_mode)) {
+    const char *base = strrchr(tokens[1], '/');
+    base = base != NULL ? base + 1 : tokens[1];
+    path = (char *)malloc(strlen(dst) + strlen(base) + 2);
+    sprintf(path, "%s/%s", dst, base);
+    dst = path;
+  }
+
+  // Truncating the source would lose it
+  if (stat(dst, &dst_st) == 0 && dst_st.st_dev == src_st.st_dev &&
+      dst_st.st_ino == src_st.st_ino) {
+    printf("Shell: %s and %s are the same file\n", tokens[1], dst);
+    close(in);
+    free(path);
+    return 1;
+  }
+
+  out = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+             src_st.st_mode & 0777);
+  if (out == -1) {
+    printf("Shell: Can't open %s\n", dst);
+    close(in);
+    free(path);
+    return 1;
+  }
+  ret = copy_fd(in, out) == 0 ? 0 : 1;
+  close(in);
+  close(out);
+  free(path);
+  return ret;
+}
+
+/**
+ * @fn builtin_cd
+ * @param[in] tokens
+ * @param[in] c
+ * @return exit code
+ */
+int builtin_cd(char **tokens, struct chain *c) {
+  // Check for format of argument
+  if (tokens[1] == NULL || tokens[2] != NULL) {
+    printf("Shell: Incorrect command\n");
+    return 1;
+  }
+  int l = chdir(tokens[1]);
+  if (l == -1) {
+    printf("Shell: Directory not found\n");
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * @fn builtin_echo
+ * @param[in] tokens
+ * @param[in] c
+ * @return exit code
+ * @brief "echo [-n] args..."
+ */
+int builtin_echo(char **tokens, struct chain *c) {
+  char **args = tokens + 1;
+  int newline = 1;
+
+  if (*args != NULL && !strcmp(*args, "-n")) {
+    newline = 0;
+    ++args;
+  }
+  for (; *args != NULL; ++args) {
+    fputs(*args, stdout);
+    if (args[1] != NULL) {
+      putchar(' ');
+    }
+  }
+  if (newline) {
+    putchar('\n');
+  }
+  return ferror(stdout) ? 1 : 0;
+}
+
+/**
+ * @fn builtin_true
+ * @param[in] tokens
+ * @param[in] c
+ * @return 0
+ */
+int builtin_true(char **tokens, struct chain *c) { return 0; }
+
+/**
+ * @fn builtin_false
+ * @param[in] tokens
+ * @param[in] c
+ * @return 1
+ */
+int builtin_false(char **tokens, struct chain *c) { return 1; }
+
+/**
+ * @fn builtin_pwd
+ * @param[in] tokens
+ * @param[in] c
+ * @return exit code
+ */
+int builtin_pwd(char **tokens, struct chain *c) {
+  char *cwd = getcwd(NULL, 0);
+
+  if (cwd == NULL) {
+    printf("Shell: Directory not found\n");
+    return 1;
+  }
+  puts(cwd);
+  free(cwd);
+  return 0;
+}
+
+/**
+ * @fn sleep_done
+ * @param[in] sl
+ * @param[in] status
+ * @brief End a sleep of the shell: the chain goes on
+ */
+void sleep_done(struct sleeper *sl, int status) {
+  struct chain *c = sl->chain;
+
+  event_del(&sl->src);
+  close(sl->src.fd);
+  *sl->link = sl->next;
+  if (sl->next != NULL) {
+    sl->next->link = sl->link;
+  }
+  free(sl);
+
+  c->status = status;
+  if (--c->pending == 0) {
+    chain_advance(c);
+  }
+}
+
+/**
+ * @fn on_sleep_timer
+ * @param[in] src
+ * @param[in] events
+ * @brief Event handler of a sleep's timerfd
+ */
+void on_sleep_timer(struct event_source *src, unsigned events) {
+  sleep_done((struct sleeper *)src->data, 0);
+}
+
+/**
+ * @fn sleep_cancel
+ * @brief End every sleep of the shell (on interrupt)
+ */
+void sleep_cancel(void) {
+  while (sleepers != NULL) {
+    TRACE(TRACE_PROC, "cancel", "\"cmd\":\"sleep\",\"fd\":%d",
+          sleepers->src.fd);
+    sleep_done(sleepers, 128 + SIGINT);
+  }
+}
+
+/**
+ * @fn builtin_sleep
+ * @param[in] tokens
+ * @param[in] c
+ * @return exit code, BUILTIN_PENDING when the chain waits for a timer
+ * @brief "sleep duration...": in the shell, the chain waits on a timerfd so
+ *        the event loop keeps running other chains meanwhile
+ */
+int builtin_sleep(char **tokens, struct chain *c) {
+  struct itimerspec its;
+  long ns = 0, d;
+  int i;
+
+  for (i = 1; tokens[i] != NULL; ++i) {
+    if (parse_duration(tokens[i], &d) == -1) {
+      break;
+    }
+    ns += d;
+  }
+  if (i == 1 || tokens[i] != NULL) {
+    printf("Shell: Incorrect command\n");
+    return 1;
+  }
+
+  if (c == NULL) {
+    // Forked shell, just block
+    struct timespec ts = {ns / 1000000000L, ns % 1000000000L};
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+      ;
+    return 0;
+  } else if (ns == 0) {
+    return 0;
+  }
+
+  struct sleeper *sl = (struct sleeper *)malloc(sizeof(struct sleeper));
+  sl->src.fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (sl->src.fd == -1) {
+    free(sl);
+    printf("Shell: Error while calling timerfd_create\n");
+    return 1;
+  }
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = ns / 1000000000L;
+  its.it_value.tv_nsec = ns % 1000000000L;
+  timerfd_settime(sl->src.fd, 0, &its, NULL);
+  sl->src.handler = on_sleep_timer;
+  sl->src.data = sl;
+  sl->chain = c;
+  event_add(&sl->src, EPOLLIN);
+
+  sl->next = sleepers;
+  if (sleepers != NULL) {
+    sleepers->link = &sl->next;
+  }
+  sl->link = &sleepers;
+  sleepers = sl;
+  c->pending++;
+  c->last_pid = 0;
+  return BUILTIN_PENDING;
+}
+
+/**
+ * @fn test_unary
+ * @param[in] op
+ * @param[in] arg
+ * @return 1 if true, 0 if false, -1 if op isn't a unary operator
+ */
+int test_unary(const char *op, const char *arg) {
+  struct stat st;
+
+  if (!strcmp(op, "-n")) {
+    return arg[0] != '\0';
+  } else if (!strcmp(op, "-z")) {
+    return arg[0] == '\0';
+  } else if (!strcmp(op, "-r")) {
+    return access(arg, R_OK) == 0;
+  } else if (!strcmp(op, "-w")) {
+    return access(arg, W_OK) == 0;
+  } else if (!strcmp(op, "-x")) {
+    return access(arg, X_OK) == 0;
+  } else if (strlen(op) != 2 || op[0] != '-' || !strchr("efdsL", op[1])) {
+    return -1;
+  } else if ((op[1] == 'L' ? lstat(arg, &st) : stat(arg, &st)) == -1) {
+    return 0;
+  }
+
+  switch (op[1]) {
+  case 'f':
+    return S_ISREG(st.st_mode);
+  case 'd':
+    return S_ISDIR(st.st_mode);
+  case 's':
+    return st.st_size > 0;
+  case 'L':
+    return S_ISLNK(st.st_mode);
+  }
+  return 1;
+}
+
+/**
+ * @fn test_binary
+ * @param[in] a
+ * @param[in] op
+ * @param[in] b
+ * @return 1 if true, 0 if false, -1 if op isn't a binary operator
+ */
+int test_binary(const char *a, const char *op, const char *b) {
+  const char *ops[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+  char *end_a, *end_b;
+  int i;
+
+  if (!strcmp(op, "=") || !strcmp(op, "==")) {
+    return !strcmp(a, b);
+  } else if (!strcmp(op, "!=")) {
+    return strcmp(a, b) != 0;
+  }
+
+  for (i = 0; i < 6 && strcmp(op, ops[i]); ++i)
+    ;
+  long x = strtol(a, &end_a, 10), y = strtol(b, &end_b, 10);
+  if (i == 6 || *a == '\0' || *end_a != '\0' || *b == '\0' ||
+      *end_b != '\0') {
+    return -1;
+  }
+  int results[] = {x == y, x != y, x < y, x <= y, x > y, x >= y};
+  return results[i];
+}
+
+/**
+ * @fn test_expr
+ * @param[in] args
+ * @param[in] n
+ * @return 1 if true, 0 if false, -1 on syntax error
+ * @brief Evaluate a test expression of up to 4 arguments (POSIX rules)
+ */
+int test_expr(char **args, int n) {
+  int r;
+
+  if (n == 0) {
+    return 0;
+  } else if (!strcmp(args[0], "!") && n > 1) {
+    r = test_expr(args + 1, n - 1);
+    return r == -1 ? -1 : !r;
+  } else if (n == 1) {
+    return args[0][0] != '\0';
+  } else if (n == 2) {
+    return test_unary(args[0], args[1]);
+  } else if (n == 3 && (r = test_binary(args[0], args[1], args[2])) != -1) {
+    return r;
+  } else if (n == 3 && !strcmp(args[0], "(") && !strcmp(args[2], ")")) {
+    return test_expr(args + 1, 1);
+  }
+  return -1;
+}
+
+/**
+ * @fn builtin_test
+ * @param[in] tokens
+ * @param[in] c
+ * @return 0 if the expression is true, 1 if false, 2 on error
+ * @brief "test expr" and "[ expr ]"
+ */
+int builtin_test(char **tokens, struct chain *c) {
+  int n;
+
+  for (n = 0; tokens[n + 1] != NULL; ++n)
+    ;
+  if (!strcmp(tokens[0], "[")) {
+    if (n == 0 || strcmp(tokens[n], "]")) {
+      printf("Shell: Incorrect command\n");
+      return 2;
+    }
+    --n;
+  }
+
+  int r = test_expr(tokens + 1, n);
+  if (r == -1) {
+    printf("Shell: Incorrect command\n");
+    return 2;
+  }
+  return !r;
+}
+
+/**
+ * @fn history_open
+ * @param[in] record Whether lines are added to it
+ * @brief Open the history log ($HISTFILE, ~/.shell_history by default)
+ */
+void history_open(int record) {
+  const char *path = getenv("HISTFILE");
+  char *buf = NULL;
+
+  if (path == NULL || *path == '\0') {
+    const char *home = getenv("HOME");
+    if (home == NULL) {
+      return;
+    }
+    buf = (char *)malloc(strlen(home) + sizeof("/.shell_history"));
+    sprintf(buf, "%s/.shell_history", home);
+    path = buf;
+  }
+  history.fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+  history.record = record;
+  free(buf);
+}
+
+/**
+ * @fn history_add
+ * @param[in] line
+ * @brief Append line to the log. Each line goes in a single write under an
+ *        exclusive lock, so lines of concurrent shells never mix
+ */
+void history_add(const char *line) {
+  struct iovec iov[2];
+  size_t len = strlen(line);
+
+  if (history.fd < 0 || !history.record || line[strspn(line, " \t")] == '\0') {
+    return;
+  }
+  iov[0].iov_base = (void *)line;
+  iov[0].iov_len = len;
+  iov[1].iov_base = (void *)"\n";
+  iov[1].iov_len = 1;
+  flock(history.fd, LOCK_EX);
+  writev(history.fd, iov, 2);
+  flock(history.fd, LOCK_UN);
+}
+
+/**
+ * @fn history_drop_index
+ * @brief Forget the search indexes (rebuilt on the next search)
+ */
+void history_drop_index(void) {
+  free(history.sorted);
+  free(history.latest);
+  free(history.tri_start);
+  free(history.tri_lines);
+  history.sorted = history.latest = NULL;
+  history.tri_start = history.tri_lines = NULL;
+  history.sorted_lines = history.trigram_lines = 0;
+}
+
+/**
+ * @fn history_refresh
+ * @return 0 on success, -1 if there is no history
+ * @brief Map what was appended to the log since last time (by any shell)
+ *        and split the new complete lines
+ */
+int history_refresh(void) {
+  struct stat st;
+  size_t off;
+  char *nl;
+
+  if (history.fd < 0 || fstat(history.fd, &st) == -1) {
+    return -1;
+  }
+  if ((size_t)st.st_size < history.mapped) {
+    // Truncated behind our back, start over
+    munmap(history.map, history.mapped);
+    history.map = NULL;
+    history.mapped = 0;
+    history.count = 0;
+    history_drop_index();
+  }
+  if ((size_t)st.st_size > history.mapped) {
+    void *map = history.map == NULL
+                    ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+                           history.fd, 0)
+                    : mremap(history.map, history.mapped, st.st_size,
+                             MREMAP_MAYMOVE);
+    if (map == MAP_FAILED) {
+      return -1;
+    }
+    history.map = (char *)map;
+    history.mapped = st.st_size;
+  }
+
+  if (history.offs == NULL) {
+    history.cap = HISTORY_BATCH;
+    history.offs = (size_t *)malloc(history.cap * sizeof(size_t));
+    history.offs[0] = 0;
+  }
+  off = history.offs[history.count];
+  while (off < history.mapped &&
+         (nl = (char *)memchr(history.map + off, '\n',
+                              history.mapped - off)) != NULL) {
+    if (history.count + 1 == history.cap) {
+      history.cap *= 2;
+      history.offs =
+          (size_t *)realloc(history.offs, history.cap * sizeof(size_t));
+      if (history.offs == NULL) {
+        printf("Shell: Out of memory\n");
+        exit(1);
+      }
+    }
+    off = nl - history.map + 1;
+    history.offs[++history.count] = off;
+  }
+  return 0;
+}
+
+/**
+ * @fn history_line
+ * @param[in] i
+ * @param[out] len
+ * @return start of line i in the mapped log (not terminated)
+ */
+const char *history_line(int i, size_t *len) {
+  *len = history.offs[i + 1] - history.offs[i] - 1;
+  return history.map + history.offs[i];
+}
+
+/**
+ * @fn history_key
+ * @param[in] line
+ * @param[in] len
+ * @param[in] from
+ * @return bytes from to from + 7 of line, packed to compare as text
+ */
+unsigned long history_key(const char *line, size_t len, size_t from) {
+  unsigned long key = 0;
+  size_t k;
+
+  for (k = from; k < from + 8; ++k) {
+    key = key << 8 | (k < len ? (unsigned char)line[k] : 0);
+  }
+  return key;
+}
+
+/**
+ * @fn history_compare
+ * @param[in] a
+ * @param[in] b
+ * @return order of the texts of two lines, for qsort. Their first 16 bytes
+ *         are compared without going back to the log
+ */
+int history_compare(const void *a, const void *b) {
+  const struct history_key *x = (const struct history_key *)a;
+  const struct history_key *y = (const struct history_key *)b;
+  size_t alen, blen;
+  const char *s, *t;
+  int r;
+
+  if (x->key[0] != y->key[0]) {
+    return x->key[0] < y->key[0] ? -1 : 1;
+  }
+  if (x->key[1] != y->key[1]) {
+    return x->key[1] < y->key[1] ? -1 : 1;
+  }
+  s = history_line(x->line, &alen);
+  t = history_line(y->line, &blen);
+  r = memcmp(s, t, alen < blen ? alen : blen);
+  return r != 0 ? r : (alen > blen) - (alen < blen);
+}
+
+/**
+ * @fn history_trigram
+ * @param[in] p
+ * @return bucket of the three bytes at p
+ */
+unsigned history_trigram(const char *p) {
+  unsigned t = (unsigned char)p[0] << 16 | (unsigned char)p[1] << 8 |
+               (unsigned char)p[2];
+  return (t * 2654435761u) >> (32 - HISTORY_TRIGRAM_BITS);
+}
+
+/**
+ * @fn history_radix
+ * @param[in] keys
+ * @param[in] tmp As large as keys
+ * @param[in] n
+ * @brief Sort keys by their 16 bytes, 16 bits at a time from the last ones
+ */
+void history_radix(struct history_key *keys, struct history_key *tmp, int n) {
+  static int count[1 << 16];
+  struct history_key *from = keys, *to = tmp, *swap;
+  int pass, i, sum;
+
+  // Even number of passes, so the result ends up in keys
+  for (pass = 0; pass < 8; ++pass) {
+    int shift = 16 * (pass % 4);
+    int word = pass < 4;
+
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < n; ++i) {
+      count[from[i].key[word] >> shift & 0xffff]++;
+    }
+    for (i = sum = 0; i < 1 << 16; ++i) {
+      int c = count[i];
+      count[i] = sum;
+      sum += c;
+    }
+    for (i = 0; i < n; ++i) {
+      to[count[from[i].key[word] >> shift & 0xffff]++] = from[i];
+    }
+    swap = from;
+    from = to;
+    to = swap;
+  }
+}
+
+/**
+ * @fn history_index_prefix
+ * @brief Sort every line by text, with a max tree of line numbers over that
+ *        order (latest line of a range sharing a prefix)
+ */
+void history_index_prefix(void) {
+  int i, j, n = history.count;
+  struct history_key *keys, *tmp;
+  const char *line;
+  size_t len;
+
+  free(history.sorted);
+  free(history.latest);
+  history.sorted = (int *)malloc(n * sizeof(int));
+  history.latest = (int *)malloc(2 * n * sizeof(int));
+  keys = (struct history_key *)malloc(n * sizeof(struct history_key));
+  tmp = (struct history_key *)malloc(n * sizeof(struct history_key));
+  if (history.sorted == NULL || history.latest == NULL || keys == NULL ||
+      tmp == NULL) {
+    printf("Shell: Out of memory\n");
+    exit(1);
+  }
+
+  // Sort with the start of each line at hand, the log is only read again
+  // for lines whose first 16 bytes are the same
+  for (i = 0; i < n; ++i) {
+    line = history_line(i, &len);
+    keys[i].key[0] = history_key(line, len, 0);
+    keys[i].key[1] = history_key(line, len, 8);
+    keys[i].line = i;
+  }
+  history_radix(keys, tmp, n);
+  for (i = 0; i < n; i = j) {
+    for (j = i + 1; j < n && keys[j].key[0] == keys[i].key[0] &&
+                    keys[j].key[1] == keys[i].key[1];
+         ++j)
+      ;
+    if (j - i > 1) {
+      qsort(keys + i, j - i, sizeof(struct history_key), history_compare);
+    }
+  }
+
+  for (i = 0; i < n; ++i) {
+    history.sorted[i] = keys[i].line;
+    history.latest[n + i] = keys[i].line;
+  }
+  for (i = n - 1; i > 0; --i) {
+    int l = history.latest[2 * i], r = history.latest[2 * i + 1];
+    history.latest[i] = l > r ? l : r;
+  }
+  free(keys);
+  free(tmp);
+  history.sorted_lines = n;
+}
+
+/**
+ * @fn history_index_trigrams
+ * @brief List, in order, the lines with a trigram of each bucket
+ */
+void history_index_trigrams(void) {
+  int i, n = history.count, buckets = 1 << HISTORY_TRIGRAM_BITS;
+  int *last, *fill;
+  const char *line;
+  size_t len, k;
+
+  free(history.tri_start);
+  free(history.tri_lines);
+  history.tri_start = (int *)calloc(buckets + 1, sizeof(int));
+  last = (int *)malloc(buckets * sizeof(int));
+  fill = (int *)malloc(buckets * sizeof(int));
+  if (history.tri_start == NULL || last == NULL || fill == NULL) {
+    printf("Shell: Out of memory\n");
+    exit(1);
+  }
+
+  // Count, then fill, each line once per bucket it has a trigram in
+  memset(last, -1, buckets * sizeof(int));
+  for (i = 0; i < n; ++i) {
+    line = history_line(i, &len);
+    for (k = 0; k + 3 <= len; ++k) {
+      unsigned t = history_trigram(line + k);
+      if (last[t] != i) {
+        last[t] = i;
+        history.tri_start[t + 1]++;
+      }
+    }
+  }
+  for (i = 0; i < buckets; ++i) {
+    history.tri_start[i + 1] += history.tri_start[i];
+  }
+  history.tri_lines = (int *)malloc(
+      (history.tri_start[buckets] ? history.tri_start[buckets] : 1) *
+      sizeof(int));
+  if (history.tri_lines == NULL) {
+    printf("Shell: Out of memory\n");
+    exit(1);
+  }
+  memset(last, -1, buckets * sizeof(int));
+  memcpy(fill, history.tri_start, buckets * sizeof(int));
+  for (i = 0; i < n; ++i) {
+    line = history_line(i, &len);
+    for (k = 0; k + 3 <= len; ++k) {
+      unsigned t = history_trigram(line + k);
+      if (last[t] != i) {
+        last[t] = i;
+        history.tri_lines[fill[t]++] = i;
+      }
+    }
+  }
+  free(fill);
+  free(last);
+  history.trigram_lines = n;
+}
+
+/**
+ * @fn history_match
+ * @param[in] i
+ * @param[in] pat
+ * @param[in] plen
+ * @param[in] prefix Whether pat must start the line, or be anywhere in it
+ * @return whether line i matches
+ */
+int history_match(int i, const char *pat, size_t plen, int prefix) {
+  size_t len;
+  const char *line = history_line(i, &len);
+
+  if (prefix) {
+    return len >= plen && !memcmp(line, pat, plen);
+  }
+  return memmem(line, len, pat, plen) != NULL;
+}
+
+/**
+ * @fn history_prefix_cmp
+ * @param[in] i
+ * @param[in] pat
+ * @param[in] plen
+ * @return order of line i against the lines starting with pat
+ */
+int history_prefix_cmp(int i, const char *pat, size_t plen) {
+  size_t len;
+  const char *line = history_line(i, &len);
+  int r = memcmp(line, pat, len < plen ? len : plen);
+
+  return r != 0 ? r : len < plen ? -1 : 0;
+}
+
+/**
+ * @fn history_prefix_range
+ * @param[in] pat
+ * @param[in] plen
+ * @param[out] lo
+ * @param[out] hi
+ * @brief Find the lines starting with pat, sorted[lo] to sorted[hi - 1]
+ */
+void history_prefix_range(const char *pat, size_t plen, int *lo, int *hi) {
+  int l = 0, r = history.sorted_lines, m;
+
+  while (l < r) {
+    m = (l + r) / 2;
+    if (history_prefix_cmp(history.sorted[m], pat, plen) < 0) {
+      l = m + 1;
+    } else {
+      r = m;
+    }
+  }
+  *lo = l;
+  for (r = history.sorted_lines; l < r;) {
+    m = (l + r) / 2;
+    if (history_prefix_cmp(history.sorted[m], pat, plen) <= 0) {
+      l = m + 1;
+    } else {
+      r = m;
+    }
+  }
+  *hi = l;
+}
+
+/**
+ * @fn history_trigram_lines
+ * @param[in] pat At least 3 bytes long
+ * @param[in] plen
+ * @param[out] n
+ * @return lines of the rarest trigram bucket of pat (to be verified)
+ */
+const int *history_trigram_lines(const char *pat, size_t plen, int *n) {
+  unsigned t, best = history_trigram(pat);
+  size_t k;
+
+  for (k = 1; k + 3 <= plen; ++k) {
+    t = history_trigram(pat + k);
+    if (history.tri_start[t + 1] - history.tri_start[t] <
+        history.tri_start[best + 1] - history.tri_start[best]) {
+      best = t;
+    }
+  }
+  *n = history.tri_start[best + 1] - history.tri_start[best];
+  return history.tri_lines + history.tri_start[best];
+}
+
+/**
+ * @fn history_prepare
+ * @param[in] prefix Whether the prefix index is needed, or the trigram one
+ * @return number of lines the index covers (the ones after it are scanned
+ *         one by one), -1 if there is no history
+ * @brief Refresh the log, and rebuild the index once it misses too many
+ */
+int history_prepare(int prefix) {
+  int indexed, tail;
+
+  if (history_refresh() == -1) {
+    return -1;
+  }
+  indexed = prefix ? history.sorted_lines : history.trigram_lines;
+  tail = history.count - indexed;
+  if (tail > HISTORY_TAIL && tail > indexed / 8) {
+    if (prefix) {
+      history_index_prefix();
+    } else {
+      history_index_trigrams();
+    }
+    indexed = history.count;
+  }
+  return indexed;
+}
+
+/**
+ * @fn history_latest
+ * @param[in] pat
+ * @param[in] plen
+ * @param[in] prefix Whether pat must start the line, or be anywhere in it
+ * @return latest line matching, -1 if none
+ */
+int history_latest(const char *pat, size_t plen, int prefix) {
+  int i, n, lo, hi, best = -1;
+  int indexed = history_prepare(prefix);
+  const int *lines;
+
+  if (indexed == -1) {
+    return -1;
+  }
+  for (i = history.count - 1; i >= indexed; --i) {
+    if (history_match(i, pat, plen, prefix)) {
+      return i;
+    }
+  }
+
+  if (prefix) {
+    // Largest line number of the range, from the max tree
+    history_prefix_range(pat, plen, &lo, &hi);
+    for (lo += indexed, hi += indexed; lo < hi; lo /= 2, hi /= 2) {
+      if (lo & 1) {
+        best = history.latest[lo] > best ? history.latest[lo] : best;
+        ++lo;
+      }
+      if (hi & 1) {
+        --hi;
+        best = history.latest[hi] > best ? history.latest[hi] : best;
+      }
+    }
+    return best;
+  }
+
+  if (plen < 3 || indexed == 0) {
+    // Too short for trigrams, but then matches are common
+    for (i = indexed - 1; i >= 0; --i) {
+      if (history_match(i, pat, plen, 0)) {
+        return i;
+      }
+    }
+    return -1;
+  }
+  lines = history_trigram_lines(pat, plen, &n);
+  for (i = n - 1; i >= 0; --i) {
+    if (history_match(lines[i], pat, plen, 0)) {
+      return lines[i];
+    }
+  }
+  return -1;
+}
+
+/**
+ * @fn compare_int
+ * @param[in] a
+ * @param[in] b
+ * @return order of the two ints, for qsort
+ */
+int compare_int(const void *a, const void *b) {
+  int x = *(const int *)a, y = *(const int *)b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * @fn history_matches
+ * @param[in] pat
+ * @param[in] plen
+ * @param[in] prefix Whether pat must start the line, or be anywhere in it
+ * @param[out] n
+ * @return every line matching, in order (allocated in line_arena)
+ */
+int *history_matches(const char *pat, size_t plen, int prefix, int *n) {
+  int i, k = 0, lo, hi, count;
+  int indexed = history_prepare(prefix);
+  const int *lines = NULL;
+  int *out;
+
+  *n = 0;
+  if (indexed == -1) {
+    return NULL;
+  }
+
+  // Candidates from the index, then the lines after it
+  if (indexed == 0) {
+    count = 0;
+  } else if (prefix) {
+    history_prefix_range(pat, plen, &lo, &hi);
+    lines = history.sorted + lo;
+    count = hi - lo;
+  } else if (plen >= 3) {
+    lines = history_trigram_lines(pat, plen, &count);
+  } else {
+    count = indexed;
+  }
+  out = (int *)arena_alloc(&line_arena,
+                           (count + history.count - indexed) * sizeof(int) +
+                               1);
+  for (i = 0; i < count; ++i) {
+    int line = lines != NULL ? lines[i] : i;
+    if (prefix || history_match(line, pat, plen, 0)) {
+      out[k++] = line;
+    }
+  }
+  if (prefix) {
+    qsort(out, k, sizeof(int), compare_int);
+  }
+  for (i = indexed; i < history.count; ++i) {
+    if (history_match(i, pat, plen, prefix)) {
+      out[k++] = i;
+    }
+  }
+  *n = k;
+  return out;
+}
+
+/**
+ * @fn history_expand
+ * @param[in] line Starting with "!!", "!n", "!?text" or "!prefix"
+ * @return line with its first word replaced by the line of history it
+ *         designates (allocated in line_arena), NULL if there is none
+ */
+char *history_expand(const char *line) {
+  const char *word = line + 1, *rest = line + strcspn(line, " \t");
+  size_t wlen = rest - word, len;
+  int i = -1;
+
+  if (wlen == 1 && *word == '!') {
+    if (history_refresh() == 0 && history.count > 0) {
+      i = history.count - 1;
+    }
+  } else if (*word == '?') {
+    i = history_latest(word + 1, wlen - 1, 0);
+  } else if (strspn(word, "0123456789") == wlen) {
+    i = atoi(word) - 1;
+    if (history_refresh() == -1 || i >= history.count) {
+      i = -1;
+    }
+  } else {
+    i = history_latest(word, wlen, 1);
+  }
+  if (i < 0) {
+    printf("Shell: %.*s: event not found\n", (int)wlen + 1, line);
+    return NULL;
+  }
+
+  const char *text = history_line(i, &len);
+  char *out = (char *)arena_alloc(&line_arena, len + strlen(rest) + 1);
+  memcpy(out, text, len);
+  strcpy(out + len, rest);
+  // Show what is run
+  puts(out);
+  return out;
+}
+
+/**
+ * @fn builtin_history
+ * @param[in] tokens
+ * @param[in] c
+ * @return exit code
+ * @brief "history [n]" lists all (or the last n) lines of history,
+ *        "history -p prefix" and "history -s text" those matching
+ */
+int builtin_history(char **tokens, struct chain *c) {
+  int i, n, first = 0, *lines = NULL;
+  size_t len;
+  const char *line;
+
+  if (tokens[1] != NULL && (!strcmp(tokens[1], "-p") ||
+                            !strcmp(tokens[1], "-s"))) {
+    if (tokens[2] == NULL || tokens[3] != NULL) {
+      printf("Shell: Incorrect command\n");
+      return 1;
+    }
+    lines = history_matches(tokens[2], strlen(tokens[2]), tokens[1][1] == 'p',
+                            &n);
+  } else if (tokens[1] != NULL &&
+             (tokens[2] != NULL || atoi(tokens[1]) <= 0)) {
+    printf("Shell: Incorrect command\n");
+    return 1;
+  } else if (history_refresh() == 0) {
+    n = history.count;
+    if (tokens[1] != NULL && atoi(tokens[1]) < n) {
+      first = n - atoi(tokens[1]);
+    }
+  } else {
+    n = 0;
+  }
+
+  for (i = first; i < n; ++i) {
+    int k = lines != NULL ? lines[i] : i;
+    line = history_line(k, &len);
+    printf("%6d  %.*s\n", k + 1, (int)len, line);
+  }
+  return 0;
+}
+
+/**
+ * @fn builtin_pins
+ * @param[in] tokens
+ * @param[in] c
+ * @return exit code
+ * @brief Print the placement policy, the nodes and the CPUs each running
+ *        child may use (with the node it was placed on)
+ */
+int builtin_pins(char **tokens, struct chain *c) {
+  char list[1024];
+  cpu_set_t set;
+  size_t i;
+  int k;
+
+  if (tokens[1] != NULL) {
+    printf("Shell: Incorrect command\n");
+    return 1;
+  }
+  topology_load();
+  printf("placement %s, membind %s\n", place_names[place_policy],
+         place_membind ? "on" : "off");
+  for (k = 0; k < topology.nnodes; ++k) {
+    if (topology.node_id[k] >= 0) {
+      printf("node %d: %s\n", topology.node_id[k],
+             cpulist_format(&topology.node_cpus[k], list, sizeof(list)));
+    } else {
+      printf("node ?: %s\n",
+             cpulist_format(&topology.node_cpus[k], list, sizeof(list)));
+    }
+  }
+
+  printf("%-8s %-5s %s\n", "PID", "NODE", "CPUS");
+  for (i = 0; i < procs.nbuckets; ++i) {
+    struct proc *p;
+    for (p = procs.buckets[i]; p != NULL; p = p->next) {
+      if (sched_getaffinity(p->pid, sizeof(set), &set) == -1) {
+        continue;
+      }
+      if (p->place >= 0 && topology.node_id[topology.cpu_node[p->place]] >= 0) {
+        printf("%-8d %-5d %s\n", p->pid,
+               topology.node_id[topology.cpu_node[p->place]],
+               cpulist_format(&set, list, sizeof(list)));
+      } else {
+        printf("%-8d %-5s %s\n", p->pid, "-",
+               cpulist_format(&set, list, sizeof(list)));
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * @fn builtin_renice
+ * @param[in] tokens
+ * @param[in] c
+ * @return exit code
+ * @brief "renice" lists the background jobs with their priority,
+ *        "renice <spec> [pid...]" changes it (of every background job when
+ *        no pid is given), for the job's whole process group
+ */
+int builtin_renice(char **tokens, struct chain *c) {
+  struct priority prio;
+  struct proc *p;
+  char spec[64];
+  size_t i;
+  int k, ret = 0;
+
+  if (tokens[1] == NULL) {
+    printf("%-8s %s\n", "PID", "PRIORITY");
+    for (i = 0; i < procs.nbuckets; ++i) {
+      for (p = procs.buckets[i]; p != NULL; p = p->next) {
+        if (!p->background) {
+          continue;
+        }
+        errno = 0;
+        prio.nice = getpriority(PRIO_PROCESS, p->pid);
+        prio.policy = sched_getscheduler(p->pid);
+        k = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, p->pid);
+        if (prio.policy == -1 || k == -1 || errno != 0) {
+          continue;
+        }
+        prio.io_idle = IOPRIO_PRIO_CLASS(k) == IOPRIO_CLASS_IDLE;
+        printf("%-8d %s\n", p->pid, priority_format(&prio, spec, sizeof(spec)));
+      }
+    }
+    return 0;
+  }
+  if (priority_parse(tokens[1], &prio) == -1) {
+    printf("Shell: Incorrect command\n");
+    return 1;
+  }
+
+  if (tokens[2] == NULL) {
+    for (i = 0; i < procs.nbuckets; ++i) {
+      for (p = procs.buckets[i]; p != NULL; p = p->next) {
+        if (p->background && priority_apply_job(p->pid, &prio) == -1) {
+          printf("Shell: Can't change priority of %d\n", p->pid);
+          ret = 1;
+        }
+      }
+    }
+    return ret;
+  }
+  for (k = 2; tokens[k] != NULL; ++k) {
+    char *end;
+    long pid = strtol(tokens[k], &end, 10);
+    p = *end == '\0' && pid > 0 ? proc_find(pid) : NULL;
+    if (p == NULL || !p->background) {
+      printf("Shell: No such job %s\n", tokens[k]);
+      ret = 1;
+    } else if (priority_apply_job(pid, &prio) == -1) {
+      printf("Shell: Can't change priority of %ld\n", pid);
+      ret = 1;
+    }
+  }
+  return ret;
+}
+
+int builtin_dag(char **tokens, struct chain *c);
+
+// Builtin commands, looked up by name through builtin_index
+const struct builtin_cmd builtins[] = {
+    {"cd", builtin_cd, 0},       {"echo", builtin_echo, 0},
+    {"true", builtin_true, 0},   {"false", builtin_false, 0},
+    {"pwd", builtin_pwd, 0},     {"sleep", builtin_sleep, 0},
+    {"test", builtin_test, 0},   {"[", builtin_test, 0},
+    {"set", builtin_set, 0},     {"spawnstat", builtin_spawnstat, 0},
+    {"hash", builtin_hash, 0},   {"tee", tee_stage, 1},
+    {"cat", builtin_cat, BUILTIN_FORKS_STDIN}, {"cp", builtin_cp, 0},
+    {"history", builtin_history, 0}, {"pins", builtin_pins, 0},
+    {"renice", builtin_renice, 0},   {"dag", builtin_dag, 0},
+    {"stats", builtin_stats, 0},
+};
+const struct builtin_cmd *builtin_index[BUILTIN_BUCKETS];
+
+/**
+ * @fn builtin_find
+ * @param[in] name
+ * @return the builtin, NULL if name isn't one
+ * @brief Look the builtin up in an open addressing table (filled on first
+ *        use), so checking a command costs one hash and a compare or two
+ */
+const struct builtin_cmd *builtin_find(const char *name) {
+  static int filled;
+  size_t i, k;
+
+  if (!filled) {
+    for (k = 0; k < sizeof(builtins) / sizeof(builtins[0]); ++k) {
+      i = hash_name(builtins[k].name) & (BUILTIN_BUCKETS - 1);
+      while (builtin_index[i] != NULL) {
+        i = (i + 1) & (BUILTIN_BUCKETS - 1);
+      }
+      builtin_index[i] = &builtins[k];
+    }
+    filled = 1;
+  }
+
+  i = hash_name(name) & (BUILTIN_BUCKETS - 1);
+  for (; builtin_index[i] != NULL; i = (i + 1) & (BUILTIN_BUCKETS - 1)) {
+    if (!strcmp(builtin_index[i]->name, name)) {
+      return builtin_index[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @fn dir_lookup
+ * @param[in] path
+ * @return cache entry of the directory (new ones are empty, not scanned)
+ */
+struct dir_cache *dir_lookup(const char *path) {
+  struct dir_cache **link = &dir_caches[hash_name(path) % DIR_BUCKETS];
+  struct dir_cache *d;
+
+  for (d = *link; d != NULL; d = d->next) {
+    if (!strcmp(d->path, path)) {
+      return d;
+    }
+  }
+  d = (struct dir_cache *)calloc(1, sizeof(struct dir_cache));
+  d->path = strdup(path);
+  d->fd = -1;
+  d->next = *link;
+  *link = d;
+  return d;
+}
+
+/**
+ * @fn compare_name
+ * @param[in] a
+ * @param[in] b
+ * @return order of the two names, for qsort
+ */
+int compare_name(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * @fn dir_scan_step
+ * @param[in] d
+ * @return 1 if there is more to read, 0 once the listing is complete
+ * @brief Read one batch of entries of the directory with getdents64
+ *        (starting over if it wasn't being read). Names are kept in one
+ *        block, each after a byte with its type, and sorted at the end
+ */
+int dir_scan_step(struct dir_cache *d) {
+  static char buf[DIR_BATCH];
+  struct stat st;
+  ssize_t n, k;
+  int i;
+
+  if (d->fd < 0) {
+    d->used = 0;
+    d->count = 0;
+    d->complete = 0;
+    free(d->sorted);
+    d->sorted = NULL;
+    // A listing went away, so did the names pointing into it
+    path_index.stale = 1;
+    d->fd = open(d->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (d->fd < 0 || fstat(d->fd, &st) == -1) {
+      memset(&d->mtime, 0, sizeof(d->mtime));
+      if (d->fd >= 0) {
+        close(d->fd);
+        d->fd = -1;
+      }
+      d->complete = 1;
+      return 0;
+    }
+    d->mtime = st.st_mtim;
+  }
+
+  n = getdents64(d->fd, buf, sizeof(buf));
+  for (k = 0; k < n;) {
+    struct dirent64 *e = (struct dirent64 *)(buf + k);
+    size_t len = strlen(e->d_name);
+    k += e->d_reclen;
+    if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) {
+      continue;
+    }
+    if (d->used + len + 2 > d->cap) {
+      d->cap = d->cap ? 2 * d->cap : DIR_BATCH;
+      while (d->used + len + 2 > d->cap) {
+        d->cap *= 2;
+      }
+      d->names = (char *)realloc(d->names, d->cap);
+      if (d->names == NULL) {
+        printf("Shell: Out of memory\n");
+        exit(1);
+      }
+    }
+    d->names[d->used++] = e->d_type;
+    memcpy(d->names + d->used, e->d_name, len + 1);
+    d->used += len + 1;
+    d->count++;
+  }
+  if (n > 0) {
+    return 1;
+  }
+
+  close(d->fd);
+  d->fd = -1;
+  d->sorted = (char **)malloc((d->count ? d->count : 1) * sizeof(char *));
+  for (i = 0, k = 0; i < d->count; ++i) {
+    d->sorted[i] = d->names + k + 1;
+    k += strlen(d->names + k + 1) + 2;
+  }
+  qsort(d->sorted, d->count, sizeof(char *), compare_name);
+  d->complete = 1;
+  return 0;
+}
+
+/**
+ * @fn dir_changed
+ * @param[in] d
+ * @return whether the directory changed since it was listed
+ */
+int dir_changed(struct dir_cache *d) {
+  struct stat st;
+
+  if (stat(d->path, &st) == -1) {
+    return d->mtime.tv_sec != 0 || d->mtime.tv_nsec != 0;
+  }
+  return st.st_mtim.tv_sec != d->mtime.tv_sec ||
+         st.st_mtim.tv_nsec != d->mtime.tv_nsec;
+}
+
+/**
+ * @fn dir_get
+ * @param[in] path
+ * @return up to date listing of the directory
+ */
+struct dir_cache *dir_get(const char *path) {
+  struct dir_cache *d = dir_lookup(path);
+
+  if (d->complete && dir_changed(d)) {
+    d->complete = 0;
+  }
+  while (!d->complete && dir_scan_step(d))
+    ;
+  return d;
+}
+
+/**
+ * @fn dir_range
+ * @param[in] d
+ * @param[in] prefix
+ * @param[in] len
+ * @param[out] lo
+ * @return number of names starting with prefix, from d->sorted[lo]
+ */
+int dir_range(struct dir_cache *d, const char *prefix, size_t len, int *lo) {
+  int l = 0, r = d->count, m, first;
+
+  while (l < r) {
+    m = (l + r) / 2;
+    if (strncmp(d->sorted[m], prefix, len) < 0) {
+      l = m + 1;
+    } else {
+      r = m;
+    }
+  }
+  first = l;
+  for (r = d->count; l < r;) {
+    m = (l + r) / 2;
+    if (strncmp(d->sorted[m], prefix, len) <= 0) {
+      l = m + 1;
+    } else {
+      r = m;
+    }
+  }
+  *lo = first;
+  return l - first;
+}
+
+/**
+ * @fn path_index_dirs
+ * @brief Take the directories of PATH again if it changed
+ */
+void path_index_dirs(void) {
+  const char *path = getenv("PATH");
+  char *copy, *dir, *save;
+
+  if (path == NULL) {
+    path = "";
+  }
+  if (path_index.path_env != NULL && !strcmp(path_index.path_env, path)) {
+    return;
+  }
+  free(path_index.path_env);
+  free(path_index.dirs);
+  path_index.path_env = strdup(path);
+  path_index.ndirs = 0;
+  path_index.dirs = (struct dir_cache **)malloc(
+      (strlen(path) / 2 + 1) * sizeof(struct dir_cache *));
+  copy = strdup(path);
+  for (dir = strtok_r(copy, ":", &save); dir != NULL;
+       dir = strtok_r(NULL, ":", &save)) {
+    path_index.dirs[path_index.ndirs++] = dir_lookup(dir);
+  }
+  free(copy);
+  path_index.next = 0;
+  path_index.stale = 1;
+}
+
+/**
+ * @fn path_index_merge
+ * @brief Gather the names of every PATH directory (but subdirectories)
+ *        into one sorted array without duplicates
+ */
+void path_index_merge(void) {
+  int i, j, n = 0;
+
+  for (i = 0; i < path_index.ndirs; ++i) {
+    n += path_index.dirs[i]->count;
+  }
+  free(path_index.names);
+  path_index.names = (char **)malloc((n ? n : 1) * sizeof(char *));
+  for (i = n = 0; i < path_index.ndirs; ++i) {
+    struct dir_cache *d = path_index.dirs[i];
+    for (j = 0; j < d->count; ++j) {
+      if (d->sorted[j][-1] != DT_DIR) {
+        path_index.names[n++] = d->sorted[j];
+      }
+    }
+  }
+  qsort(path_index.names, n, sizeof(char *), compare_name);
+  for (i = j = 0; i < n; ++i) {
+    if (j == 0 || strcmp(path_index.names[j - 1], path_index.names[i])) {
+      path_index.names[j++] = path_index.names[i];
+    }
+  }
+  path_index.count = j;
+  path_index.stale = 0;
+}
+
+/**
+ * @fn path_index_step
+ * @return 1 if there is more to do, 0 once the index is built
+ * @brief Background task of the prompt: list one batch of the next PATH
+ *        directory, merge once all are listed
+ */
+int path_index_step(void) {
+  path_index_dirs();
+  while (path_index.next < path_index.ndirs) {
+    struct dir_cache *d = path_index.dirs[path_index.next];
+    if (!d->complete) {
+      if (dir_scan_step(d)) {
+        return 1;
+      }
+      // Listed now, one batch at a time is enough
+      path_index.next++;
+      return 1;
+    }
+    path_index.next++;
+  }
+  if (path_index.stale) {
+    path_index_merge();
+  }
+  return 0;
+}
+
+/**
+ * @fn path_index_refresh
+ * @brief Bring the index up to date, listing again only the directories
+ *        modified since they were listed
+ */
+void path_index_refresh(void) {
+  int i;
+
+  path_index_dirs();
+  for (i = 0; i < path_index.ndirs; ++i) {
+    dir_get(path_index.dirs[i]->path);
+  }
+  path_index.next = path_index.ndirs;
+  if (path_index.stale) {
+    path_index_merge();
+  }
+}
+
+/**
+ * @fn editor_write
+ * @param[in] fmt
+ * @brief printf to the terminal, right away
+ */
+void editor_write(const char *fmt, ...) {
+  va_list ap;
+
+  va_start(ap, fmt);
+  vprintf(fmt, ap);
+  va_end(ap);
+  fflush(stdout);
+}
+
+/**
+ * @fn editor_redraw
+ * @brief Print the prompt and the line again, cursor where it was
+ */
+void editor_redraw(void) {
+  struct editor *e = &editor;
+
+  editor_write("\r%s%.*s\x1b[K", e->prompt, (int)e->len, e->buf);
+  if (e->pos < e->len) {
+    editor_write("\x1b[%zuD", e->len - e->pos);
+  }
+}
+
+/**
+ * @fn editor_insert
+ * @param[in] text
+ * @param[in] len
+ * @brief Insert text at the cursor
+ */
+void editor_insert(const char *text, size_t len) {
+  struct editor *e = &editor;
+
+  if (e->len + len + 1 > e->cap) {
+    while (e->len + len + 1 > e->cap) {
+      e->cap *= 2;
+    }
+    e->buf = (char *)realloc(e->buf, e->cap);
+    if (e->buf == NULL) {
+      printf("Shell: Out of memory\n");
+      exit(1);
+    }
+  }
+  memmove(e->buf + e->pos + len, e->buf + e->pos, e->len - e->pos);
+  memcpy(e->buf + e->pos, text, len);
+  e->len += len;
+  e->pos += len;
+}
+
+/**
+ * @fn editor_delete
+ * @param[in] from
+ * @param[in] to
+ * @brief Delete the text between from and to, cursor going to from
+ */
+void editor_delete(size_t from, size_t to) {
+  struct editor *e = &editor;
+
+  memmove(e->buf + from, e->buf + to, e->len - to);
+  e->len -= to - from;
+  e->pos = from;
+}
+
+/**
+ * @fn editor_set
+ * @param[in] text
+ * @param[in] len
+ * @brief Replace the whole line
+ */
+void editor_set(const char *text, size_t len) {
+  editor.len = editor.pos = 0;
+  editor_insert(text, len);
+}
+
+/**
+ * @fn editor_show
+ * @param[in] names
+ * @param[in] n
+ * @brief List completions below the line, then draw it again
+ */
+void editor_show(const char **names, int n) {
+  int i, col = 0;
+
+  editor_write("\n");
+  for (i = 0; i < n && i < EDITOR_MAX_SHOWN; ++i) {
+    int len = strlen(names[i]);
+    if (col > 0 && col + len + 2 > 80) {
+      editor_write("\n");
+      col = 0;
+    }
+    editor_write("%s  ", names[i]);
+    col += len + 2;
+  }
+  if (n > EDITOR_MAX_SHOWN) {
+    editor_write("\n(%d more)", n - EDITOR_MAX_SHOWN);
+  }
+  editor_write("\n");
+  editor_redraw();
+}
+
+/**
+ * @fn editor_complete
+ * @brief Complete the word before the cursor: a command from the PATH
+ *        index and builtins in command position, a file otherwise. The
+ *        common part is inserted, a second Tab lists the choices
+ */
+void editor_complete(void) {
+  struct editor *e = &editor;
+  size_t start, k, j, wlen, plen, common;
+  const char **names, *word, *base;
+  char *dir = NULL, *file;
+  struct dir_cache *d = NULL;
+  int i, n = 0, lo, count, command;
+
+  for (start = e->pos; start > 0 && e->buf[start - 1] != ' ' &&
+                       e->buf[start - 1] != '\t';
+       --start)
+    ;
+  word = e->buf + start;
+  wlen = e->pos - start;
+
+  // Command position: first word, or after an operator or "time"
+  for (k = start; k > 0 && (e->buf[k - 1] == ' ' || e->buf[k - 1] == '\t');
+       --k)
+    ;
+  size_t prev = k;
+  while (prev > 0 && e->buf[prev - 1] != ' ' && e->buf[prev - 1] != '\t') {
+    --prev;
+  }
+  command = k == 0;
+  if (!command) {
+    static const char *ops[] = {"|", "&", "&&", "&&&", "time"};
+    for (j = 0; j < sizeof(ops) / sizeof(ops[0]); ++j) {
+      if (k - prev == strlen(ops[j]) &&
+          !memcmp(e->buf + prev, ops[j], k - prev)) {
+        command = 1;
+      }
+    }
+  }
+  if (memchr(word, '/', wlen) != NULL) {
+    command = 0;
+  }
+
+  if (command) {
+    path_index_refresh();
+    count = path_index.count;
+    names = (const char **)arena_alloc(
+        &line_arena,
+        (count + sizeof(builtins) / sizeof(builtins[0])) * sizeof(char *));
+    for (j = 0; j < sizeof(builtins) / sizeof(builtins[0]); ++j) {
+      if (!strncmp(builtins[j].name, word, wlen)) {
+        names[n++] = builtins[j].name;
+      }
+    }
+    // Binary search of the range starting with word
+    int l = 0, r = count, m;
+    while (l < r) {
+      m = (l + r) / 2;
+      if (strncmp(path_index.names[m], word, wlen) < 0) {
+        l = m + 1;
+      } else {
+        r = m;
+      }
+    }
+    for (; l < count && !strncmp(path_index.names[l], word, wlen); ++l) {
+      names[n++] = path_index.names[l];
+    }
+    base = word;
+    plen = wlen;
+  } else {
+    // Directory part of the word (up to its last '/'), and the name in it
+    const char *slash = (const char *)memrchr(word, '/', wlen);
+    base = slash != NULL ? slash + 1 : word;
+    plen = word + wlen - base;
+    if (slash == NULL) {
+      dir = strdup(".");
+    } else if (slash == word) {
+      dir = strdup("/");
+    } else {
+      dir = strndup(word, slash - word);
+    }
+    d = dir_get(dir);
+    count = dir_range(d, base, plen, &lo);
+    names = (const char **)arena_alloc(&line_arena,
+                                       (count ? count : 1) * sizeof(char *));
+    for (i = lo; i < lo + count; ++i) {
+      // Hidden files only when asked for
+      if (d->sorted[i][0] != '.' || (plen > 0 && base[0] == '.')) {
+        names[n++] = d->sorted[i];
+      }
+    }
+  }
+
+  if (n == 0) {
+    free(dir);
+    return;
+  }
+  if (n > 1) {
+    // Builtins may also be in PATH
+    qsort(names, n, sizeof(char *), compare_name);
+    for (i = k = 1; i < n; ++i) {
+      if (strcmp(names[k - 1], names[i])) {
+        names[k++] = names[i];
+      }
+    }
+    n = k;
+  }
+
+  // Part common to all of them
+  common = strlen(names[0]);
+  for (i = 1; i < n; ++i) {
+    for (k = 0; k < common && names[i][k] == names[0][k]; ++k)
+      ;
+    common = k;
+  }
+
+  if (n == 1) {
+    editor_insert(names[0] + plen, common - plen);
+    int is_dir = 0;
+    if (d != NULL) {
+      // Follow symlinks and unknown types to tell directories apart
+      file = (char *)malloc(strlen(dir) + strlen(names[0]) + 2);
+      sprintf(file, "%s/%s", dir, names[0]);
+      struct stat st;
+      is_dir = names[0][-1] == DT_DIR ||
+               ((names[0][-1] == DT_LNK || names[0][-1] == DT_UNKNOWN) &&
+                stat(file, &st) == 0 && S_ISDIR(st.st_mode));
+      free(file);
+    }
+    editor_insert(is_dir ? "/" : " ", 1);
+    editor_redraw();
+  } else if (common > plen) {
+    editor_insert(names[0] + plen, common - plen);
+    editor_redraw();
+  } else if (e->tabs > 1) {
+    editor_show(names, n);
+  } else {
+    editor_write("\a");
+  }
+  free(dir);
+}
+
+/**
+ * @fn editor_history
+ * @param[in] step -1 for an older line, 1 for a newer one
+ * @brief Show a line of history (the one being typed past the newest)
+ */
+void editor_history(int step) {
+  struct editor *e = &editor;
+  const char *line;
+  size_t len;
+
+  if (history_refresh() == -1) {
+    return;
+  }
+  if (e->hist < 0) {
+    // Leaving the typed line, keep it
+    free(e->typed);
+    e->typed = strndup(e->buf, e->len);
+    e->hist = history.count;
+  }
+  if (e->hist + step < 0 || e->hist + step > history.count) {
+    editor_write("\a");
+    return;
+  }
+  e->hist += step;
+  if (e->hist == history.count) {
+    editor_set(e->typed, strlen(e->typed));
+  } else {
+    line = history_line(e->hist, &len);
+    editor_set(line, len);
+  }
+  editor_redraw();
+}
+
+/**
+ * @fn editor_key
+ * @return next byte typed, -1 on end of input
+ * @brief Read ahead from the terminal, running the event loop (and the
+ *        background tasks) while waiting
+ */
+int editor_key(void) {
+  struct editor *e = &editor;
+  ssize_t n;
+
+  while (e->in_start == e->in_end) {
+    at_prompt = 1;
+    wait_readable(STDIN_FILENO);
+    at_prompt = 0;
+    n = read(STDIN_FILENO, e->in, sizeof(e->in));
+    if (n == 0 || (n == -1 && errno != EINTR && errno != EAGAIN)) {
+      return -1;
+    }
+    e->in_start = 0;
+    e->in_end = n > 0 ? n : 0;
+  }
+  return (unsigned char)e->in[e->in_start++];
+}
+
+/**
+ * @fn editor_getline
+ * @param[in] prompt
+ * @return line typed (valid until the next call), NULL on end of input
+ * @brief Read a line from the terminal in raw mode, with editing keys,
+ *        history (up/down) and completion (Tab)
+ */
+char *editor_getline(const char *prompt) {
+  struct editor *e = &editor;
+  struct termios raw;
+  int ch, done = 0;
+
+  if (e->buf == NULL) {
+    e->cap = 256;
+    e->buf = (char *)malloc(e->cap);
+  }
+  e->prompt = prompt;
+  e->len = e->pos = 0;
+  e->hist = -1;
+  e->tabs = 0;
+
+  tcgetattr(STDIN_FILENO, &e->saved);
+  raw = e->saved;
+  raw.c_iflag &= ~(ICRNL | IXON);
+  raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+  editor_redraw();
+
+  while (!done) {
+    ch = editor_key();
+    e->tabs = ch == '\t' ? e->tabs + 1 : 0;
+    switch (ch) {
+    case -1:
+      // End of input, the line typed so far is dropped
+      done = -1;
+      break;
+    case '\r':
+    case '\n':
+      done = 1;
+      break;
+    case 3: // Ctrl-C
+      editor_write("^C\n");
+      e->len = e->pos = 0;
+      e->hist = -1;
+      editor_redraw();
+      break;
+    case 4: // Ctrl-D
+      if (e->len == 0) {
+        done = -1;
+      } else if (e->pos < e->len) {
+        editor_delete(e->pos, e->pos + 1);
+        editor_redraw();
+      }
+      break;
+    case 127:
+    case 8: // Backspace
+      if (e->pos > 0) {
+        editor_delete(e->pos - 1, e->pos);
+        editor_redraw();
+      }
+      break;
+    case 1: // Ctrl-A
+      e->pos = 0;
+      editor_redraw();
+      break;
+    case 5: // Ctrl-E
+      e->pos = e->len;
+      editor_redraw();
+      break;
+    case 11: // Ctrl-K
+      e->len = e->pos;
+      editor_redraw();
+      break;
+    case 12: // Ctrl-L
+      editor_write("\x1b[H\x1b[2J");
+      editor_redraw();
+      break;
+    case 21: // Ctrl-U
+      editor_delete(0, e->pos);
+      editor_redraw();
+      break;
+    case 23: { // Ctrl-W
+      size_t k = e->pos;
+      while (k > 0 && e->buf[k - 1] == ' ') {
+        --k;
+      }
+      while (k > 0 && e->buf[k - 1] != ' ') {
+        --k;
+      }
+      editor_delete(k, e->pos);
+      editor_redraw();
+      break;
+    }
+    case '\t':
+      editor_complete();
+      break;
+    case 27: // Escape sequences of the arrow, Home, End and Delete keys
+      if (editor_key() != '[') {
+        break;
+      }
+      ch = editor_key();
+      if (ch == 'A' || ch == 'B') {
+        editor_history(ch == 'A' ? -1 : 1);
+      } else if (ch == 'C' && e->pos < e->len) {
+        e->pos++;
+        editor_redraw();
+      } else if (ch == 'D' && e->pos > 0) {
+        e->pos--;
+        editor_redraw();
+      } else if (ch == 'H' || ch == 'F') {
+        e->pos = ch == 'H' ? 0 : e->len;
+        editor_redraw();
+      } else if (ch >= '1' && ch <= '8' && editor_key() == '~') {
+        // Keypad style: Home is 1 or 7, End 4 or 8, Delete 3 (others,
+        // such as Page Up, are ignored)
+        if (ch == '1' || ch == '7' || ch == '4' || ch == '8') {
+          e->pos = ch == '1' || ch == '7' ? 0 : e->len;
+          editor_redraw();
+        } else if (ch == '3' && e->pos < e->len) {
+          editor_delete(e->pos, e->pos + 1);
+          editor_redraw();
+        }
+      }
+      break;
+    default:
+      if (ch >= ' ') {
+        char c = ch;
+        editor_insert(&c, 1);
+        editor_redraw();
+      }
+    }
+  }
+
+  editor_write("\n");
+  tcsetattr(STDIN_FILENO, TCSADRAIN, &e->saved);
+  if (done == -1) {
+    return NULL;
+  }
+  e->buf[e->len] = '\0';
+  return e->buf;
+}
+
+/**
+ * @fn fork_run
+ * @param[in] tokens
+ * @param[in] pgid Process group to join (0 for a new one, -1 to inherit)
+ * @param[in] fds Descriptors for stdin, stdout and stderr (NULL or -1 to
+ *                inherit)
+ * @return child PID, -1 on error
+ * @brief Run a builtin in a forked shell (where it can't affect this one)
+ */
+int fork_run(char **tokens, int pgid, const int *fds) {
+  long start;
+  int i;
+
+  fflush(stdout);
+  start = now_ns();
+  if (spawn_place >= 0) {
+    place_enter(spawn_place);
+  }
+  int ret = fork();
+  // The child keeps its place, the shell goes back to its own
+  if (ret != 0 && spawn_place >= 0) {
+    place_leave();
+  }
+  if (ret < 0) {
+    TRACE(TRACE_PROC, "exec-fail",
+          "\"engine\":\"fork\",\"errno\":%d,\"latency_ns\":%ld,"
+          "\"cmd\":\"%s\"",
+          errno, now_ns() - start, trace_str(tokens[0]));
+    stats.exec_failures++;
+    printf("Shell: Error while calling fork\n");
+  } else if (ret == 0) {
+    // Child process
+    msgs_child();
+    // A group whose members have all ended can't be joined, lead a new one
+    if (pgid >= 0 && setpgid(0, pgid) == -1) {
+      setpgid(0, 0);
+    }
+    // Before it runs, so what it launches inherits the priority
+    if (spawn_priority != NULL && priority_apply(0, spawn_priority) == -1) {
+      printf("Shell: Can't change priority of %d\n", getpid());
+      fflush(stdout);
+    }
+    for (i = 0; fds != NULL && i < 3; ++i) {
+      if (fds[i] >= 0) {
+        dup2(fds[i], i);
+      }
+    }
+    // What it launches goes in its group, the terminal stays where it is
+    signals_restore();
+    fg_group.pgid = getpgrp();
+    fg_group.tty = -1;
+    // Don't hold the shell's descriptors (or other ends of a pipeline) open
+    close_range(3, ~0U, 0);
+    exit(builtin_find(tokens[0])->fn(tokens, NULL));
+  } else {
+    hist_record(&stats.fork, now_ns() - start);
+    TRACE(TRACE_PROC, "spawn",
+          "\"pid\":%d,\"pgid\":%d,\"engine\":\"fork\",\"latency_ns\":%ld,"
+          "\"cmd\":\"%s\"",
+          ret, pgid < 0 ? getpgrp() : pgid > 0 ? pgid : ret, now_ns() - start,
+          trace_str(tokens[0]));
+  }
+  return ret;
+}
+
+/**
+ * @fn redirect_close
+ * @param[in] base
+ * @param[in] fds
+ * @brief Close the files opened by redirect (once the command has them)
+ */
+void redirect_close(const int *base, int *fds) {
+  int k;
+
+  for (k = 0; k < 3; ++k) {
+    if (fds[k] >= 0 && (base == NULL || fds[k] != base[k])) {
+      close(fds[k]);
+      fds[k] = -1;
+    }
+  }
+}
+
+/**
+ * @fn redirect
+ * @param[in] tokens Command, redirections are taken out of it
+ * @param[in] base Descriptors the command gets otherwise (NULL if none)
+ * @param[out] fds Descriptors for stdin, stdout and stderr (-1 to inherit)
+ * @return 0 on success, -1 on error
+ * @brief Open the files of "< file", "> file", ">> file" and "2> file".
+ *        They are close-on-exec, only the copies made in the child stay
+ */
+int redirect(char **tokens, const int *base, int *fds) {
+  int i, j, k, flags, fd;
+
+  for (k = 0; k < 3; ++k) {
+    fds[k] = base != NULL ? base[k] : -1;
+  }
+  for (i = j = 0; tokens[i] != NULL;) {
+    if (!strcmp(tokens[i], "<")) {
+      k = 0;
+      flags = O_RDONLY;
+    } else if (!strcmp(tokens[i], ">")) {
+      k = 1;
+      flags = O_WRONLY | O_CREAT | O_TRUNC;
+    } else if (!strcmp(tokens[i], ">>")) {
+      k = 1;
+      flags = O_WRONLY | O_CREAT | O_APPEND;
+    } else if (!strcmp(tokens[i], "2>")) {
+      k = 2;
+      flags = O_WRONLY | O_CREAT | O_TRUNC;
+    } else {
+      tokens[j++] = tokens[i++];
+      continue;
+    }
+
+    if (tokens[i + 1] == NULL) {
+      printf("Shell: Incorrect command\n");
+      redirect_close(base, fds);
+      return -1;
+    }
+    fd = open(tokens[i + 1], flags | O_CLOEXEC, 0666);
+    if (fd == -1) {
+      printf("Shell: Can't open %s\n", tokens[i + 1]);
+      redirect_close(base, fds);
+      return -1;
+    }
+    // The last redirection of a descriptor wins
+    if (fds[k] >= 0 && (base == NULL || fds[k] != base[k])) {
+      close(fds[k]);
+    }
+    fds[k] = fd;
+    i += 2;
+  }
+  tokens[j] = NULL;
+  return 0;
+}
+
+/**
+ * @fn fds_push
+ * @param[in] fds Descriptors for stdin, stdout and stderr (-1 to keep)
+ * @param[out] saved Copies of the replaced ones (-1 if kept)
+ * @brief Redirect the shell itself, for a builtin run in it
+ */
+void fds_push(const int *fds, int *saved) {
+  int k;
+
+  fflush(stdout);
+  for (k = 0; k < 3; ++k) {
+    saved[k] = -1;
+    if (fds != NULL && fds[k] >= 0) {
+      saved[k] = fcntl(k, F_DUPFD_CLOEXEC, 3);
+      dup2(fds[k], k);
+    }
+  }
+}
+
+/**
+ * @fn fds_pop
+ * @param[in] saved
+ * @brief Put back the descriptors replaced by fds_push
+ */
+void fds_pop(const int *saved) {
+  int k;
+
+  fflush(stdout);
+  for (k = 0; k < 3; ++k) {
+    if (saved[k] >= 0) {
+      dup2(saved[k], k);
+      close(saved[k]);
+    }
+  }
+}
+
+/**
+ * @fn watchdog_signal
+ * @param[in] w
+ * @param[in] sig
+ * @brief Signal the children of the watched command, or of every command
+ *        of the line (those not reaped yet, so their PIDs can't have been
+ *        reused). Sleeps of the shell end on SIGTERM
+ */
+void watchdog_signal(struct watchdog *w, int sig) {
+  struct chain *c = w->chain;
+  struct line_group *g = w->group;
+  struct sleeper *sl, *next;
+  struct proc *p;
+  size_t i;
+
+  // The line's whole group, with what its commands started, or that of
+  // the timed command
+  if (c == NULL && g->active && g->pgid > 0) {
+    killpg(g->pgid, sig);
+  } else if (c != NULL && c->own_group && c->pgid > 0) {
+    killpg(c->pgid, sig);
+  }
+  for (i = 0; i < procs.nbuckets; ++i) {
+    for (p = procs.buckets[i]; p != NULL; p = p->next) {
+      struct chain *pc = (struct chain *)p->data;
+      if (p->on_exit != chain_proc_done || p->done ||
+          (c != NULL ? pc != c : pc->group != g)) {
+        continue;
+      }
+      pc->timed_out = 1;
+      if (c == NULL && pc->own_group && p->pid == pc->pgid) {
+        killpg(pc->pgid, sig);
+      } else {
+        kill(p->pid, sig);
+      }
+    }
+  }
+  for (sl = sleepers; sl != NULL; sl = next) {
+    next = sl->next;
+    if (c != NULL ? sl->chain == c : sl->chain->group == g) {
+      sl->chain->timed_out = 1;
+      sleep_done(sl, 128 + SIGTERM);
+    }
+  }
+}
+
+/**
+ * @fn on_watchdog
+ * @param[in] src
+ * @param[in] events
+ * @brief Event handler of a watchdog's timerfd: SIGTERM when time is up,
+ *        SIGKILL if still running KILL_GRACE_MS later
+ */
+void on_watchdog(struct event_source *src, unsigned events) {
+  struct watchdog *w = (struct watchdog *)src->data;
+  struct itimerspec its;
+  uint64_t ticks;
+
+  read(src->fd, &ticks, sizeof(ticks));
+  TRACE(TRACE_PROC, "timeout", "\"signal\":%d,\"line\":%d",
+        w->fired ? SIGKILL : SIGTERM, w->chain == NULL);
+  if (w->fired) {
+    watchdog_signal(w, SIGKILL);
+    return;
+  }
+  w->fired = 1;
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = KILL_GRACE_MS / 1000;
+  its.it_value.tv_nsec = KILL_GRACE_MS % 1000 * 1000000L;
+  timerfd_settime(src->fd, 0, &its, NULL);
+  if (w->chain == NULL) {
+    line_stop(w->group);
+  }
+  watchdog_signal(w, SIGTERM);
+}
+
+/**
+ * @fn watchdog_start
+ * @param[in] c Chain whose current command is watched, NULL for a line
+ * @param[in] g The line when c is NULL
+ * @param[in] ns Time it may run
+ * @return the watchdog, NULL on error
+ */
+struct watchdog *watchdog_start(struct chain *c, struct line_group *g,
+                                long ns) {
+  struct watchdog *w = (struct watchdog *)malloc(sizeof(struct watchdog));
+  struct itimerspec its;
+
+  w->src.fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (w->src.fd == -1) {
+    free(w);
+    printf("Shell: Error while calling timerfd_create\n");
+    return NULL;
+  }
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = ns / 1000000000L;
+  its.it_value.tv_nsec = ns % 1000000000L;
+  timerfd_settime(w->src.fd, 0, &its, NULL);
+  w->src.handler = on_watchdog;
+  w->src.data = w;
+  w->chain = c;
+  w->group = g;
+  w->fired = 0;
+  event_add(&w->src, EPOLLIN);
+  return w;
+}
+
+/**
+ * @fn watchdog_stop
+ * @param[in] w
+ * @return whether time was up
+ */
+int watchdog_stop(struct watchdog *w) {
+  int fired = w->fired;
+
+  event_del(&w->src);
+  close(w->src.fd);
+  free(w);
+  return fired;
+}
+
+/**
+ * @fn background
+ * @param[in] tokens
+ * @param[in] b Builtin of the command, NULL for an executable
+ * @param[in] fds Descriptors for stdin, stdout and stderr (-1 to inherit)
+ * @brief Run the command by spawning the executable (forking for builtins).
+ *        Don't wait for it to end (run as background process)
+ */
+void background(char **tokens, const struct builtin_cmd *b,
+                const int *fds) {
+  int ret;
+
+  if (tokens[0] == NULL) {
+    // Nothing to do
+    return;
+  } else if (b != NULL) {
+    // Doesn't make sense to run builtins in background
+    // Even then, run them in a different process group
+    ret = fork_run(tokens, 0, fds);
+  } else {
+    // Launch the executable in a different process group
+    ret = spawn(tokens, 0, fds);
+  }
+  if (ret > 0) {
+    proc_add(ret, 1);
+  }
+}
+
+/**
+ * @fn builtin_forks
+ * @param[in] b
+ * @param[in] tokens
+ * @return whether the builtin has to run in a forked shell. Files end, so
+ *         one reading only files can run in the shell, but stdin (no file
+ *         or "-") may be the terminal or a pipe that never does
+ */
+int builtin_forks(const struct builtin_cmd *b, char **tokens) {
+  int i;
+
+  if (b->forks != BUILTIN_FORKS_STDIN) {
+    return b->forks;
+  }
+  for (i = 1; tokens[i] != NULL; ++i) {
+    if (!strcmp(tokens[i], "-")) {
+      return 1;
+    }
+  }
+  return i == 1;
+}
+
+/**
+ * @fn normal
+ * @param[in] tokens
+ * @param[in] b Builtin of the command, NULL for an executable
+ * @param[in] c Chain the command is part of
+ * @param[in] fds Descriptors for stdin, stdout and stderr (-1 to inherit)
+ * @brief Run the command by spawning the executable (except builtins, run
+ *        in the shell itself when the chain allows it).
+ *        The chain goes on when it ends (run as foreground process)
+ */
+void normal(char **tokens, const struct builtin_cmd *b, struct chain *c,
+            const int *fds) {
+  int ret, saved[3];
+
+  if (tokens[0] == NULL) {
+    // Nothing to do
+  } else if (b != NULL && c->in_shell && !builtin_forks(b, tokens)) {
+    fds_push(fds, saved);
+    ret = b->fn(tokens, c);
+    fds_pop(saved);
+    if (ret != BUILTIN_PENDING) {
+      c->status = ret;
+    }
+  } else {
+    if (b != NULL) {
+      ret = fork_run(tokens, chain_pgid(c), fds);
+    } else {
+      // Launch the executable in the line's process group (or its own)
+      ret = spawn(tokens, chain_pgid(c), fds);
+    }
+    if (ret > 0) {
+      chain_track(c, ret);
+    } else {
+      c->status = 127;
+    }
+  }
+}
+
+/**
+ * @fn launch_stage
+ * @param[in] tokens
+ * @param[in] pgid
+ * @param[in] fds
+ * @return child PID, -1 on error
+ * @brief Launch one stage of a pipeline (builtins run in a forked shell)
+ */
+int launch_stage(char **tokens, int pgid, const int *fds) {
+  if (builtin_find(tokens[0]) != NULL) {
+    return fork_run(tokens, pgid, fds);
+  }
+  return spawn(tokens, pgid, fds);
+}
+
+/**
+ * @fn pipeline
+ * @param[in] tokens
+ * @param[in] pgid Process group to join (0 for a new one, -1 to inherit)
+ * @param[out] pids
+ * @param[in] base stdin of the first stage, stdout of the last one and
+ *                 stderr of all (-1 to inherit)
+ * @return number of stages (pids of those which failed to launch are -1)
+ * @brief Splits the token into stages based on "|".
+ *        Launch them connected by pipes, without waiting
+ */
+int pipeline(char **tokens, int pgid, int *pids, const int *base) {
+  char **ptokens = tokens;
+  int i, n = 0, p[2], fds[3] = {base[0], -1, base[2]};
+
+  for (i = 0;; ++i) {
+    int last = tokens[i] == NULL;
+    if (!last && tokens[i] != op_pipe) {
+      continue;
+    }
+    tokens[i] = NULL;
+
+    // Output of every stage but the last goes to a new pipe
+    fds[1] = base[1];
+    if (!last) {
+      if (pipe2(p, O_CLOEXEC) == -1) {
+        printf("Shell: Error while calling pipe\n");
+        break;
+      }
+      if (pipe_size > 0) {
+        fcntl(p[1], F_SETPIPE_SZ, pipe_size);
+      }
+      fds[1] = p[1];
+    }
+
+    // A stage's own redirections take over from the pipes
+    int ret = -1, sfds[3];
+    if (redirect(ptokens, fds, sfds) == 0) {
+      ret = launch_stage(ptokens, pgid, sfds);
+      redirect_close(fds, sfds);
+    }
+    pids[n++] = ret;
+    if (ret > 0 && pgid == 0) {
+      pgid = ret;
+    }
+
+    if (fds[0] >= 0 && fds[0] != base[0]) {
+      close(fds[0]);
+    }
+    if (last) {
+      break;
+    }
+    close(p[1]);
+    fds[0] = p[0];
+    ptokens = &tokens[i + 1];
+  }
+  return n;
+}
+
+/**
+ * @fn run
+ * @param[in] tokens
+ * @param[in] c Chain the command is part of
+ * @brief Detect background process, pipelines and redirections and
+ *        accordingly run the command
+ */
+void run(char **tokens, struct chain *c) {
+  static const int no_fds[3] = {-1, -1, -1};
+  static const struct priority normal_priority = {SCHED_OTHER, 0, 0};
+  struct priority prio;
+  long timeout = 0;
+  int i, fds[3];
+  int bg = 0, stages = 1, prefixed = 0;
+
+  // "prio <spec>" in front sets the priority of this command only,
+  // "timeout=<duration>" the time it may run in foreground
+  while (tokens[0] != NULL) {
+    if (!strcmp(tokens[0], "prio")) {
+      if (tokens[1] == NULL || priority_parse(tokens[1], &prio) == -1) {
+        printf("Shell: Incorrect command\n");
+        c->status = 1;
+        return;
+      }
+      prefixed = 1;
+      tokens += 2;
+    } else if (!strncmp(tokens[0], "timeout=", 8)) {
+      if (parse_duration(tokens[0] + 8, &timeout) == -1) {
+        printf("Shell: Incorrect command\n");
+        c->status = 1;
+        return;
+      }
+      tokens++;
+    } else {
+      break;
+    }
+  }
+  c->cmd = tokens[0];
+  c->cmd_start_ns = now_ns();
+
+  // Check if it is background (ends with "&") or not
+  for (i = 0; tokens[i] != NULL; ++i) {
+    if (tokens[i] == op_bg && tokens[i + 1] == NULL) {
+      tokens[i] = NULL;
+      bg = 1;
+      break;
+    } else if (tokens[i] == op_pipe) {
+      // Every stage needs a command
+      if (i == 0 || tokens[i + 1] == NULL || tokens[i + 1] == op_pipe ||
+          tokens[i + 1] == op_bg) {
+        printf("Shell: Incorrect command\n");
+        return;
+      }
+      ++stages;
+    }
+  }
+
+  // Background commands outlive the chain, they don't take its descriptors
+  // or its place
+  const int *base = bg ? no_fds : c->fds;
+  spawn_place = bg ? -1 : c->place;
+  c->own_group = timeout > 0 && !bg;
+  c->pgid = 0;
+  spawn_priority = prefixed ? &prio : NULL;
+  if (!prefixed && bg &&
+      memcmp(&bg_priority, &normal_priority, sizeof(prio)) != 0) {
+    spawn_priority = &bg_priority;
+  }
+
+  if (stages > 1) {
+    int *pids = (int *)arena_alloc(c->arena, stages * sizeof(int));
+    int n = pipeline(tokens, bg ? 0 : chain_pgid(c), pids, base);
+
+    for (i = 0; i < n; ++i) {
+      if (pids[i] > 0) {
+        if (bg) {
+          proc_add(pids[i], 1);
+        } else {
+          chain_track(c, pids[i]);
+        }
+      }
+    }
+    // Exit status follows the last stage
+    if (!bg && (n == 0 || pids[n - 1] < 0)) {
+      c->last_pid = -1;
+      c->status = 127;
+    }
+  } else if (redirect(tokens, base, fds) == -1) {
+    if (!bg) {
+      c->status = 1;
+    }
+  } else {
+    // Builtins are found once here for both cases
+    const struct builtin_cmd *b =
+        tokens[0] != NULL ? builtin_find(tokens[0]) : NULL;
+    if (bg) {
+      background(tokens, b, fds);
+    } else {
+      normal(tokens, b, c, fds);
+    }
+    redirect_close(base, fds);
+  }
+  spawn_place = -1;
+  spawn_priority = NULL;
+
+  if (timeout > 0 && !bg && c->pending > 0) {
+    c->watchdog = watchdog_start(c, NULL, timeout);
+  }
+}
+
+void segment_done(struct chain *c);
+
+/**
+ * @fn chain_steps
+ * @param[in] c
+ * @brief Run the commands of the chain one after another, until one has
+ *        children to wait for (or the chain is done)
+ */
+void chain_steps(struct chain *c) {
+  int i;
+
+  while (c->pending == 0) {
+    if (c->watchdog != NULL) {
+      watchdog_stop(c->watchdog);
+      c->watchdog = NULL;
+    }
+    if (c->timed_out) {
+      printf("Shell: %s timed out after %.3fs\n", c->cmd,
+             (now_ns() - c->cmd_start_ns) / 1e9);
+      c->timed_out = 0;
+    }
+    if (c->cmd_timing != NULL) {
+      timing_print(c->cmd_timing);
+      c->cmd_timing = NULL;
+    }
+
+    // Don't run if interrupt is set to 1
+    if (c->rest == NULL || interrupt == 1 || c->group->stopped) {
+      if (c->rest != NULL) {
+        TRACE(TRACE_PROC, "cancel", "\"cmd\":\"%s\"", trace_str(c->rest[0]));
+      }
+      c->done = 1;
+      last_status = c->status;
+      if (c->timed) {
+        timing_print(c->timing);
+      }
+      if (c->on_done != NULL) {
+        c->on_done(c);
+      }
+      return;
+    }
+
+    // Split the next command off at "&&"
+    char **ptokens = c->rest;
+    for (i = 0; ptokens[i] != NULL && ptokens[i] != op_and; ++i)
+      ;
+    c->rest = ptokens[i] != NULL ? &ptokens[i + 1] : NULL;
+    ptokens[i] = NULL;
+
+    // "time" just before a command is for that command only
+    if (ptokens[0] != NULL && !strcmp(ptokens[0], "time")) {
+      c->cmd_timing = timing_start(c->arena, c->timing);
+      ++ptokens;
+    }
+    TRACE(TRACE_CMD, "run", "\"cmd\":\"%s\"", trace_str(ptokens[0]));
+    run(ptokens, c);
+  }
+}
+
+struct output_queue *msgs_begin(struct output_queue *q);
+void msgs_end(struct output_queue *prev);
+
+/**
+ * @fn chain_advance
+ * @param[in] c
+ * @brief chain_steps, with the shell's messages going to the client whose
+ *        line the chain is part of, if any
+ */
+void chain_advance(struct chain *c) {
+  struct output_queue *prev;
+
+  if (c->fanout == NULL || c->fanout->msgs == NULL) {
+    chain_steps(c);
+    return;
+  }
+  prev = msgs_begin(c->fanout->msgs);
+  chain_steps(c);
+  msgs_end(prev);
+}
+
+/**
+ * @fn chain_init
+ * @param[in] c
+ * @param[in] tokens
+ * @param[in] t Enclosing timing scope, NULL if none
+ * @param[in] a Arena of the line
+ * @brief Set up a chain to run tokens, timing it if it starts with "time"
+ */
+void chain_init(struct chain *c, char **tokens, struct timing *t,
+                struct arena *a) {
+  memset(c, 0, sizeof(*c));
+  c->arena = a;
+  c->rest = tokens;
+  c->timing = t;
+  c->fds[0] = c->fds[1] = c->fds[2] = -1;
+  c->place = -1;
+  c->group = &fg_group;
+  if (tokens[0] != NULL && !strcmp(tokens[0], "time")) {
+    c->rest = tokens + 1;
+    c->timing = timing_start(a, t);
+    c->timed = 1;
+  }
+}
+
+/**
+ * @fn series
+ * @param[in] tokens
+ * @param[in] t Enclosing timing scope, NULL if none
+ * @brief Splits the token into components based on "&&".
+ *        Run them one after another in foreground, on the current shell
+ */
+void series(char **tokens, struct timing *t) {
+  struct chain c;
+
+  chain_init(&c, tokens, t, &line_arena);
+  c.in_shell = 1;
+  chain_advance(&c);
+  while (!c.done) {
+    wait_events(-1);
+  }
+}
+
+/**
+ * @fn output_open
+ * @param[in] k Descriptor to emit to
+ * @param[out] sock Whether it is a socket
+ * @return descriptor to emit output to k with
+ * @brief Terminals and pipes are opened again, non-blocking, so a slow
+ *        reader never holds up the event loop (and the segments it reads
+ *        from). Sockets can't be, they are sent to with MSG_DONTWAIT
+ *        instead. Files are written to as they are
+ */
+int output_open(int k, int *sock) {
+  struct stat st;
+  char path[32];
+  int fd, known = fstat(k, &st) == 0;
+
+  *sock = known && S_ISSOCK(st.st_mode);
+  if (known && (S_ISCHR(st.st_mode) || S_ISFIFO(st.st_mode))) {
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", k);
+    fd = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd != -1) {
+      return fd;
+    }
+  }
+  return fcntl(k, F_DUPFD_CLOEXEC, 3);
+}
+
+/**
+ * @fn output_flush
+ * @param[in] q
+ * @brief Write queued blocks in order, until done or the destination is
+ *        full (then the event loop carries on when it has room again)
+ */
+void output_flush(struct output_queue *q) {
+  struct out_chunk *ch;
+  ssize_t n;
+
+  while ((ch = q->head) != NULL) {
+    if (q->sock[ch->fd]) {
+      n = send(q->fds[ch->fd], ch->data + ch->off, ch->len - ch->off,
+               MSG_DONTWAIT | MSG_NOSIGNAL);
+    } else {
+      n = write(q->fds[ch->fd], ch->data + ch->off, ch->len - ch->off);
+    }
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1 && errno == EAGAIN) {
+      if (q->waiting != ch->fd) {
+        if (q->waiting) {
+          event_del(&q->src);
+        }
+        q->src.fd = q->fds[ch->fd];
+        event_add(&q->src, EPOLLOUT);
+        q->waiting = ch->fd;
+      }
+      return;
+    }
+    // Written, or can't be (the block is dropped)
+    if (n > 0 && (ch->off += n) < ch->len) {
+      continue;
+    }
+    q->head = ch->next;
+    if (q->head == NULL) {
+      q->tail = NULL;
+    }
+    free(ch);
+  }
+  if (q->waiting) {
+    event_del(&q->src);
+    q->waiting = 0;
+  }
+}
+
+/**
+ * @fn on_output_ready
+ * @param[in] src
+ * @param[in] events
+ * @brief Event handler of a full destination that has room again
+ */
+void on_output_ready(struct event_source *src, unsigned events) {
+  output_flush((struct output_queue *)src->data);
+}
+
+/**
+ * @fn output_push
+ * @param[in] q
+ * @param[in] fd 1 or 2
+ * @param[in] prefix Put in front of data (NULL for none)
+ * @param[in] data
+ * @param[in] len
+ * @brief Queue a block, written whole before the next one
+ */
+void output_push(struct output_queue *q, int fd, const char *prefix,
+                 const char *data, size_t len) {
+  size_t plen = prefix != NULL ? strlen(prefix) : 0;
+  struct out_chunk *ch =
+      (struct out_chunk *)malloc(sizeof(struct out_chunk) + plen + len);
+
+  if (ch == NULL) {
+    printf("Shell: Out of memory\n");
+    exit(1);
+  }
+  if (q->fds[fd] <= 0) {
+    q->fds[fd] = output_open(q->to != NULL ? q->to[fd] : fd, &q->sock[fd]);
+    q->src.handler = on_output_ready;
+    q->src.data = q;
+  }
+  ch->next = NULL;
+  ch->fd = fd;
+  ch->off = 0;
+  ch->len = plen + len;
+  memcpy(ch->data, prefix, plen);
+  memcpy(ch->data + plen, data, len);
+  if (q->tail != NULL) {
+    q->tail->next = ch;
+  } else {
+    q->head = ch;
+  }
+  q->tail = ch;
+  output_flush(q);
+}
+
+/**
+ * @fn output_drop
+ * @param[in] q
+ * @brief Forget the blocks not written yet (on interrupt)
+ */
+void output_drop(struct output_queue *q) {
+  struct out_chunk *ch;
+
+  while ((ch = q->head) != NULL) {
+    q->head = ch->next;
+    free(ch);
+  }
+  q->tail = NULL;
+  if (q->waiting) {
+    event_del(&q->src);
+    q->waiting = 0;
+  }
+}
+
+/**
+ * @fn msgs_switch
+ * @param[in] q Queue of the client the shell works for now, NULL for none
+ * @brief Queue what was printed for the previous client to its stderr,
+ *        then catch what is printed from now on for q
+ */
+void msgs_switch(struct output_queue *q) {
+  FILE *f;
+
+  fflush(stdout);
+  if (msgs.to != NULL) {
+    fclose(stdout);
+    stdout = msgs.saved;
+    if (msgs.len > 0) {
+      output_push(msgs.to, 2, NULL, msgs.buf, msgs.len);
+    }
+    free(msgs.buf);
+    msgs.to = NULL;
+  }
+  if (q != NULL && (f = open_memstream(&msgs.buf, &msgs.len)) != NULL) {
+    msgs.saved = stdout;
+    stdout = f;
+    msgs.to = q;
+  }
+}
+
+/**
+ * @fn msgs_begin
+ * @param[in] q Queue of the client the shell works for
+ * @return client it worked for until now, for msgs_end
+ */
+struct output_queue *msgs_begin(struct output_queue *q) {
+  struct output_queue *prev = msgs.to;
+
+  if (prev != q) {
+    msgs_switch(q);
+  }
+  return prev;
+}
+
+/**
+ * @fn msgs_end
+ * @param[in] prev What msgs_begin returned
+ */
+void msgs_end(struct output_queue *prev) {
+  if (msgs.to != prev) {
+    msgs_switch(prev);
+  }
+}
+
+/**
+ * @fn capture_lines
+ * @param[in] cap
+ * @param[in] all Whether a last line without newline goes too
+ * @brief Prefix mode: queue the complete lines captured so far
+ */
+void capture_lines(struct capture *cap, int all) {
+  char prefix[16];
+  size_t start = 0;
+  char *nl;
+
+  snprintf(prefix, sizeof(prefix), "[%d] ", cap->segment);
+  while ((nl = (char *)memchr(cap->buf + start, '\n', cap->len - start)) !=
+         NULL) {
+    output_push(&output, cap->out, prefix, cap->buf + start,
+                nl - cap->buf + 1 - start);
+    start = nl - cap->buf + 1;
+  }
+  if (all && start < cap->len) {
+    cap->buf[cap->len++] = '\n';
+    output_push(&output, cap->out, prefix, cap->buf + start,
+                cap->len - start);
+    start = cap->len;
+  }
+  memmove(cap->buf, cap->buf + start, cap->len - start);
+  cap->len -= start;
+}
+
+/**
+ * @fn capture_read
+ * @param[in] cap
+ * @brief Take what the segment wrote so far into its buffer (which grows as
+ *        needed), until the pipe is empty or closed
+ */
+void capture_read(struct capture *cap) {
+  ssize_t n;
+
+  while (cap->src.fd >= 0) {
+    // One spare byte for a missing last newline
+    if (cap->cap - cap->len < COPY_BUFFER_SIZE + 1) {
+      cap->cap = cap->cap ? 2 * cap->cap : 2 * COPY_BUFFER_SIZE;
+      cap->buf = (char *)realloc(cap->buf, cap->cap);
+      if (cap->buf == NULL) {
+        printf("Shell: Out of memory\n");
+        exit(1);
+      }
+    }
+    n = read(cap->src.fd, cap->buf + cap->len, COPY_BUFFER_SIZE);
+    if (n > 0) {
+      cap->len += n;
+      continue;
+    }
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == 0 || errno != EAGAIN) {
+      // Every writer is gone
+      event_del(&cap->src);
+      close(cap->src.fd);
+      cap->src.fd = -1;
+    }
+    break;
+  }
+  if (output_mode == OUTPUT_PREFIX) {
+    capture_lines(cap, 0);
+  }
+}
+
+/**
+ * @fn on_capture
+ * @param[in] src
+ * @param[in] events
+ * @brief Event handler of a segment's output pipe
+ */
+void on_capture(struct event_source *src, unsigned events) {
+  capture_read((struct capture *)src->data);
+}
+
+/**
+ * @fn capture_start
+ * @param[in] c
+ * @param[in] segment Number of the segment in the line, from 1
+ * @brief Give the chain a pipe for its stdout and one for its stderr, read
+ *        from the event loop
+ */
+void capture_start(struct chain *c, int segment) {
+  int k, p[2];
+
+  c->capture =
+      (struct capture *)arena_alloc(c->arena, 2 * sizeof(struct capture));
+  memset(c->capture, 0, 2 * sizeof(struct capture));
+  for (k = 0; k < 2; ++k) {
+    struct capture *cap = &c->capture[k];
+    cap->out = k + 1;
+    cap->segment = segment;
+    cap->src.fd = -1;
+    if (pipe2(p, O_CLOEXEC) == -1) {
+      printf("Shell: Error while calling pipe\n");
+      continue;
+    }
+    fcntl(p[0], F_SETFL, O_NONBLOCK);
+    cap->src.fd = p[0];
+    cap->src.handler = on_capture;
+    cap->src.data = cap;
+    event_add(&cap->src, EPOLLIN);
+    c->fds[k + 1] = p[1];
+  }
+}
+
+/**
+ * @fn capture_end
+ * @param[in] c
+ * @brief The segment is done: take the rest of its output and queue it, as
+ *        one block per stream in group mode
+ */
+void capture_end(struct chain *c) {
+  int k;
+
+  for (k = 0; k < 2; ++k) {
+    struct capture *cap = &c->capture[k];
+    if (c->fds[k + 1] >= 0) {
+      close(c->fds[k + 1]);
+      c->fds[k + 1] = -1;
+    }
+    // Children are gone, anything still holding the pipe is left behind
+    capture_read(cap);
+    if (cap->src.fd >= 0) {
+      event_del(&cap->src);
+      close(cap->src.fd);
+      cap->src.fd = -1;
+    }
+    if (output_mode == OUTPUT_PREFIX) {
+      capture_lines(cap, 1);
+    } else if (cap->len > 0) {
+      output_push(&output, cap->out, NULL, cap->buf, cap->len);
+    }
+    free(cap->buf);
+    cap->buf = NULL;
+  }
+}
+
+/**
+ * @fn parallel
+ * @param[in] tokens
+ * @param[in] f
+ * @return chain running the command
+ * @brief Run the command as a foreground chain driven by the event loop,
+ *        without waiting for it
+ */
+struct chain *parallel(char **tokens, struct fanout *f) {
+  struct chain *c = (struct chain *)arena_alloc(f->arena, sizeof(*c));
+
+  hist_record(&stats.queue, now_ns() - f->queued_ns);
+  chain_init(c, tokens, f->timing, f->arena);
+  c->fanout = f;
+  c->group = f->group;
+  c->on_done = segment_done;
+  c->place = place_segment(f->next - 1);
+  if (f->fds != NULL) {
+    memcpy(c->fds, f->fds, sizeof(c->fds));
+  } else if (output_mode != OUTPUT_DIRECT) {
+    // Segments are started in order, so this is the number of this one
+    capture_start(c, f->next);
+  }
+  f->running++;
+  chain_advance(c);
+  return c;
+}
+
+/**
+ * @fn fanout_fill
+ * @param[in] f
+ * @brief Start queued segments, in order, while less than max_jobs run
+ */
+void fanout_fill(struct fanout *f) {
+  // Segments ending right away come back here, let the loop go on
+  if (f->filling) {
+    return;
+  }
+  f->filling = 1;
+  while (f->next < f->count && f->running < max_jobs && !interrupt &&
+         !f->group->stopped) {
+    parallel(f->segments[f->next++], f);
+  }
+#ifdef SHELL_TRACE
+  // Queued segments that won't start after an interrupt
+  if ((interrupt || f->group->stopped) && f->next < f->count) {
+    TRACE(TRACE_PROC, "cancel", "\"segments\":%d", f->count - f->next);
+  }
+#endif
+  f->filling = 0;
+}
+
+/**
+ * @fn fanout_check
+ * @param[in] f
+ * @brief Call on_done (once) when no segment runs and none will start
+ */
+void fanout_check(struct fanout *f) {
+  void (*on_done)(struct fanout *f) = f->on_done;
+
+  if (on_done != NULL && f->running == 0 && !f->filling &&
+      (f->next >= f->count || interrupt || f->group->stopped)) {
+    f->on_done = NULL;
+    on_done(f);
+  }
+}
+
+/**
+ * @fn fanout_split
+ * @param[in] f
+ * @param[in] tokens
+ * @brief Splits the token into segments based on "&&&", in place
+ */
+void fanout_split(struct fanout *f, char **tokens) {
+  int i;
+
+  // Count the segments
+  f->count = 1;
+  for (i = 0; tokens[i] != NULL; ++i) {
+    if (tokens[i] == op_fanout) {
+      f->count++;
+    }
+  }
+  hist_record(&stats.width, f->count);
+  f->queued_ns = now_ns();
+
+  // If encountered a "&&&", segment till now is queued to run parallelly
+  f->segments = (char ***)arena_alloc(f->arena, f->count * sizeof(char **));
+  f->segments[0] = tokens;
+  f->count = 1;
+  for (i = 0; tokens[i] != NULL; ++i) {
+    if (tokens[i] == op_fanout) {
+      tokens[i] = NULL;
+      f->segments[f->count++] = &tokens[i + 1];
+    }
+  }
+}
+
+/**
+ * @fn segment_done
+ * @param[in] c
+ * @brief End of a segment's chain: its slot goes to the next queued one
+ */
+void segment_done(struct chain *c) {
+  struct fanout *f = c->fanout;
+
+  if (c->capture != NULL) {
+    capture_end(c);
+  }
+  if (c->status != 0 && f->status == 0) {
+    f->status = c->status;
+  }
+  f->running--;
+  fanout_fill(f);
+  fanout_check(f);
+}
+
 /**
- * @fn tokenize
- * @param[in] line
- * @return tokens
- * @brief Split line into tokens
+ * @fn work
+ * @param[in] tokens
+ * @brief Splits the token into components based on "&&&".
+ *        Run them parallelly in foreground, at most max_jobs at once.
+ *        "time" in front times the whole line
  */
-char **tokenize(char *line) {
-  char **tokens = (char **)malloc(MAX_NUM_TOKENS * sizeof(char *));
-  char *token = (char *)malloc(MAX_TOKEN_SIZE * sizeof(char));
-  int i, tokenIndex = 0, tokenNo = 0;
+void work(char **tokens) {
+  struct watchdog *deadline = NULL;
+  struct fanout f;
+  long start = now_ns();
 
-  for (i = 0; i < strlen(line); i++) {
+  memset(&f, 0, sizeof(f));
+  f.arena = &line_arena;
+  f.group = &fg_group;
+  if (!strcmp(tokens[0], "time")) {
+    f.timing = timing_start(&line_arena, NULL);
+    ++tokens;
+  }
 
-    char readChar = line[i];
+  // The last segment isn't counted, it runs apart
+  fanout_split(&f, tokens);
+  f.count--;
+  if (deadline_ns > 0) {
+    deadline = watchdog_start(NULL, &fg_group, deadline_ns);
+  }
+  line_begin(&fg_group);
 
-    if (readChar == ' ' || readChar == '\n' || readChar == '\t') {
-      token[tokenIndex] = '\0';
-      if (tokenIndex != 0) {
-        tokens[tokenNo] = (char *)malloc(MAX_TOKEN_SIZE * sizeof(char));
-        strcpy(tokens[tokenNo++], token);
-        tokenIndex = 0;
-      }
-    } else {
-      token[tokenIndex++] = readChar;
+  if (output_mode != OUTPUT_DIRECT && f.count > 0) {
+    // Output is captured, so every segment runs like the others
+    f.count++;
+    fanout_fill(&f);
+    while (f.running > 0 || (output.head != NULL && !interrupt)) {
+      wait_events(-1);
+    }
+    output_drop(&output);
+  } else {
+    // Last segment is run on the current shell itself, taking one slot
+    f.running = 1;
+    fanout_fill(&f);
+    series(f.segments[f.count], f.timing);
+    f.running--;
+
+    // Start the rest as slots free up, until all have ended
+    fanout_fill(&f);
+    while (f.running > 0) {
+      wait_events(-1);
     }
   }
+  line_end(&fg_group);
 
-  free(token);
-  tokens[tokenNo] = NULL;
-  return tokens;
+  if (deadline != NULL && watchdog_stop(deadline)) {
+    printf("Shell: Line stopped at its deadline, ran %.3fs\n",
+           (now_ns() - start) / 1e9);
+  }
+  if (f.timing != NULL) {
+    timing_print(f.timing);
+  }
 }
 
 /**
- * @fn background
- * @param[in] tokens
- * @brief Run the command by forking and calling executable (except cd).
- *        Don't wait for it to end (run as background process)
+ * @fn dag_estimate
+ * @param[in] name
+ * @return run time of the step when it last ran, NULL if it never did
  */
-void background(char **tokens) {
-  int i;
+struct dag_estimate *dag_estimate(const char *name) {
+  struct dag_estimate *e;
+
+  for (e = dag_estimates; e != NULL && strcmp(e->name, name); e = e->next)
+    ;
+  return e;
+}
+
+/**
+ * @fn dag_heap_push
+ * @param[in] d
+ * @param[in] k Step ready to run
+ * @brief Queue the step, the one with the longest path ahead runs first
+ */
+void dag_heap_push(struct dag *d, int k) {
+  int i = d->nready++, parent;
 
-  // Check availability of background process and set i accordingly
-  for (i = 0; i < MAX_BG_PROCESS; i++) {
-    if (background_proc[i] == -1) {
+  while (i > 0) {
+    parent = (i - 1) / 2;
+    if (d->steps[d->ready[parent]].rank_ns >= d->steps[k].rank_ns) {
       break;
     }
+    d->ready[i] = d->ready[parent];
+    i = parent;
   }
-  if (i == MAX_BG_PROCESS) {
-    printf("Shell: Can't handle more background processes\n");
-    return;
+  d->ready[i] = k;
+}
+
+/**
+ * @fn dag_heap_pop
+ * @param[in] d
+ * @return ready step with the longest path ahead
+ */
+int dag_heap_pop(struct dag *d) {
+  int top = d->ready[0], last = d->ready[--d->nready];
+  int i = 0, child;
+
+  while ((child = 2 * i + 1) < d->nready) {
+    if (child + 1 < d->nready &&
+        d->steps[d->ready[child + 1]].rank_ns >
+            d->steps[d->ready[child]].rank_ns) {
+      ++child;
+    }
+    if (d->steps[d->ready[child]].rank_ns <= d->steps[last].rank_ns) {
+      break;
+    }
+    d->ready[i] = d->ready[child];
+    i = child;
   }
+  d->ready[i] = last;
+  return top;
+}
 
-  // Fork to run the the command
-  int ret = fork();
-  if (ret < 0) {
-    printf("Shell: Error while calling fork\n");
-  } else if (ret == 0) {
-    // Child process
-    // Assign a different process group id
-    setpgid(0, 0);
+/**
+ * @fn dag_find
+ * @param[in] d
+ * @param[in] name
+ * @return index of the step, -1 if there is none of that name
+ */
+int dag_find(struct dag *d, const char *name) {
+  int i;
 
-    if (tokens[0] == NULL) {
-      // Nothing to do
-    } else if (!strcmp(tokens[0], "cd")) {
-      // Special case cd
-      // Doesn't make sense to run cd in background
-      // Even then, check for format of argument
-      if (tokens[1] == NULL || tokens[2] != NULL)
-        printf("Shell: Incorrect command\n");
-      else {
-        int l = chdir(tokens[1]);
-        if (l == -1) {
-          printf("Shell: Directory not found\n");
-        }
+  for (i = 0; i < d->count && strcmp(d->steps[i].name, name); ++i)
+    ;
+  return i < d->count ? i : -1;
+}
+
+/**
+ * @fn dag_parse
+ * @param[in] text Contents of the file (tokenized in place)
+ * @param[out] d
+ * @return 0 on success, -1 on error (reported)
+ * @brief Read "name [dep...]: command" lines (blank lines and lines
+ *        starting with "#" are skipped)
+ */
+int dag_parse(char *text, struct dag *d) {
+  char *line, *next, *colon, *p;
+  char **words;
+  int i, j, n = 1;
+
+  for (p = text; (p = strchr(p, '\n')) != NULL; ++p) {
+    n++;
+  }
+  d->steps =
+      (struct dag_step *)arena_alloc(&line_arena, n * sizeof(struct dag_step));
+  d->count = 0;
+
+  for (line = text; line != NULL; line = next) {
+    next = strchr(line, '\n');
+    if (next != NULL) {
+      *next++ = '\0';
+    }
+    line += strspn(line, " \t");
+    if (*line == '\0' || *line == '#') {
+      continue;
+    }
+    colon = strchr(line, ':');
+    if (colon == NULL || colon == line) {
+      printf("Shell: Incorrect step: %s\n", line);
+      return -1;
+    }
+    *colon = '\0';
+
+    // Name and dependencies, split in place
+    words = (char **)arena_alloc(&line_arena,
+                                 ((colon - line) / 2 + 1) * sizeof(char *));
+    n = 0;
+    for (p = line; *p != '\0';) {
+      words[n++] = p;
+      p += strcspn(p, " \t");
+      if (*p != '\0') {
+        *p++ = '\0';
+        p += strspn(p, " \t");
       }
-    } else {
-      // Load and run the executable
-      int p = execvp(tokens[0], tokens);
-      if (p == -1) {
-        printf("Shell: Incorrect command\n");
+    }
+
+    struct dag_step *st = &d->steps[d->count];
+    memset(st, 0, sizeof(*st));
+    st->name = words[0];
+    st->dep_names = words + 1;
+    st->ndeps = n - 1;
+    st->deps = (int *)arena_alloc(&line_arena, st->ndeps * sizeof(int));
+    st->tokens = tokenize(colon + 1, &line_arena);
+    if (dag_find(d, st->name) != -1) {
+      printf("Shell: Step %s defined twice\n", st->name);
+      return -1;
+    }
+    d->count++;
+  }
+
+  // Dependencies by index, and steps depending on each one
+  for (i = 0; i < d->count; ++i) {
+    struct dag_step *st = &d->steps[i];
+    for (j = 0; j < st->ndeps; ++j) {
+      st->deps[j] = dag_find(d, st->dep_names[j]);
+      if (st->deps[j] == -1) {
+        printf("Shell: Step %s needs unknown step %s\n", st->name,
+               st->dep_names[j]);
+        return -1;
       }
+      d->steps[st->deps[j]].nusers++;
+    }
+  }
+  for (i = 0; i < d->count; ++i) {
+    d->steps[i].users =
+        (int *)arena_alloc(&line_arena, d->steps[i].nusers * sizeof(int));
+    d->steps[i].nusers = 0;
+  }
+  for (i = 0; i < d->count; ++i) {
+    for (j = 0; j < d->steps[i].ndeps; ++j) {
+      struct dag_step *dep = &d->steps[d->steps[i].deps[j]];
+      dep->users[dep->nusers++] = i;
+      d->steps[i].waiting++;
     }
-    exit(0);
-  } else { // ret > 0
-    // Parent process with ret as Child PID
-    background_proc[i] = ret;
   }
+  return 0;
 }
 
 /**
- * @fn normal
- * @param[in] tokens
- * @brief Run the command by forking and calling executable (except cd).
- *        Wait for it to end (run as foreground process)
+ * @fn dag_order
+ * @param[in] d
+ * @return the steps in topological order (in line_arena), NULL if they
+ *         depend on each other in a cycle
  */
-void normal(char **tokens) {
-  if (tokens[0] == NULL) {
-    // Nothing to do
-  } else if (!strcmp(tokens[0], "cd")) {
-    // Special case cd
-    // Check for format of argument
-    if (tokens[1] == NULL || tokens[2] != NULL)
-      printf("Shell: Incorrect command\n");
-    else {
-      int l = chdir(tokens[1]);
-      if (l == -1) {
-        printf("Shell: Directory not found\n");
-      }
+int *dag_order(struct dag *d) {
+  int *order = (int *)arena_alloc(&line_arena, d->count * sizeof(int));
+  int *left = (int *)arena_alloc(&line_arena, d->count * sizeof(int));
+  int i, j, n = 0, head;
+
+  // Topological order, from the steps needing nothing
+  for (i = 0; i < d->count; ++i) {
+    left[i] = d->steps[i].ndeps;
+    if (left[i] == 0) {
+      order[n++] = i;
     }
-  } else {
-    // Fork to run the the command
-    int ret = fork();
-    if (ret < 0) {
-      printf("Shell: Error while calling fork\n");
-    } else if (ret == 0) {
-      // Child process
-      // Load and run the executable
-      int p = execvp(tokens[0], tokens);
-      if (p == -1) {
-        printf("Shell: Incorrect command\n");
-      }
-      exit(0);
-    } else { // ret > 0
-      // Parent process with ret as Child PID
-      // Wait for the child process to terminate then reap it
-      int k = waitpid(ret, NULL, 0);
-      if (k == -1) {
-        printf("Shell: Error while calling waitpid\n");
+  }
+  for (head = 0; head < n; ++head) {
+    struct dag_step *st = &d->steps[order[head]];
+    for (j = 0; j < st->nusers; ++j) {
+      if (--left[st->users[j]] == 0) {
+        order[n++] = st->users[j];
       }
     }
   }
+  return n < d->count ? NULL : order;
 }
 
 /**
- * @fn run
- * @param[in] tokens
- * @brief Detect background process and accordingly run the command
+ * @fn dag_longest
+ * @param[in] d
+ * @param[in] k
+ * @return longest rank_ns among the steps needing step k (0 for none)
+ */
+long dag_longest(struct dag *d, int k) {
+  struct dag_step *st = &d->steps[k];
+  long longest = 0;
+  int j;
+
+  for (j = 0; j < st->nusers; ++j) {
+    if (d->steps[st->users[j]].rank_ns > longest) {
+      longest = d->steps[st->users[j]].rank_ns;
+    }
+  }
+  return longest;
+}
+
+/**
+ * @fn dag_rank
+ * @param[in] d
+ * @return 0 on success, -1 if the steps depend on each other in a cycle
+ * @brief Length of the longest path from each step to the end, going by
+ *        how long steps took when they last ran (unknown ones count 1ms)
+ */
+int dag_rank(struct dag *d) {
+  int *order = dag_order(d);
+  int i;
+
+  if (order == NULL) {
+    return -1;
+  }
+  for (i = d->count - 1; i >= 0; --i) {
+    struct dag_step *st = &d->steps[order[i]];
+    struct dag_estimate *e = dag_estimate(st->name);
+    st->rank_ns = dag_longest(d, order[i]) + (e != NULL ? e->ns : 1000000L);
+  }
+  return 0;
+}
+
+void dag_fill(struct dag *d);
+
+/**
+ * @fn dag_release
+ * @param[in] d
+ * @param[in] k
+ * @param[in] ok Whether the dependency that finished succeeded
+ * @brief One of the step's dependencies is done: queue it once all are,
+ *        or skip it (and what depends on it) if one failed
  */
-void run(char **tokens) {
+void dag_release(struct dag *d, int k, int ok) {
+  struct dag_step *st = &d->steps[k];
   int i;
-  int bg = 0;
 
-  // Don't run if interrupt is set to 1
-  if (interrupt == 1) {
+  st->failed_dep |= !ok;
+  if (--st->waiting > 0) {
+    return;
+  }
+  if (!st->failed_dep) {
+    dag_heap_push(d, k);
     return;
   }
+  st->state = DAG_SKIPPED;
+  for (i = 0; i < st->nusers; ++i) {
+    dag_release(d, st->users[i], 0);
+  }
+}
 
-  // Check if it is background (ends with "&") or not
-  for (i = 0; tokens[i] != NULL; ++i) {
-    if (!strcmp(tokens[i], "&") && tokens[i + 1] == NULL) {
-      tokens[i] = NULL;
-      bg = 1;
-      break;
+/**
+ * @fn dag_step_done
+ * @param[in] c
+ * @brief End of a step's chain: what needs it may run now
+ */
+void dag_step_done(struct chain *c) {
+  struct dag_step *st = (struct dag_step *)c->data;
+  struct dag *d = st->dag;
+  struct dag_estimate *e;
+  int i;
+
+  if (c->capture != NULL) {
+    capture_end(c);
+  }
+  st->end_ns = now_ns();
+  st->status = c->status;
+  st->state = DAG_DONE;
+  d->running--;
+
+  // Next time, this is how long it is expected to take
+  e = dag_estimate(st->name);
+  if (e == NULL) {
+    e = (struct dag_estimate *)malloc(sizeof(struct dag_estimate) +
+                                      strlen(st->name) + 1);
+    strcpy(e->name, st->name);
+    e->next = dag_estimates;
+    dag_estimates = e;
+  }
+  e->ns = st->end_ns - st->start_ns;
+
+  for (i = 0; i < st->nusers; ++i) {
+    dag_release(d, st->users[i], st->status == 0);
+  }
+  dag_fill(d);
+}
+
+/**
+ * @fn dag_fill
+ * @param[in] d
+ * @brief Start ready steps, longest path first, while less than max_jobs
+ *        run
+ */
+void dag_fill(struct dag *d) {
+  // Steps ending right away come back here, let the loop go on
+  if (d->filling) {
+    return;
+  }
+  d->filling = 1;
+  while (d->nready > 0 && d->running < max_jobs && !interrupt) {
+    int k = dag_heap_pop(d);
+    struct dag_step *st = &d->steps[k];
+    struct chain *c = &st->chain;
+
+    chain_init(c, st->tokens, NULL, &line_arena);
+    c->on_done = dag_step_done;
+    c->data = st;
+    c->place = place_segment(k);
+    if (output_mode != OUTPUT_DIRECT) {
+      capture_start(c, k + 1);
     }
+    st->state = DAG_RUNNING;
+    st->start_ns = now_ns();
+    d->running++;
+    chain_advance(c);
   }
+  d->filling = 0;
+}
 
-  // Separately run background process
-  if (bg) {
-    background(tokens);
-  } else {
-    normal(tokens);
+/**
+ * @fn dag_report
+ * @param[in] d
+ * @brief Print when each step started, how long it ran and how it ended,
+ *        then the critical path: the longest path through the
+ *        dependencies, going by how long the steps ran (0 for those that
+ *        didn't), whatever waited for a job to be free
+ */
+void dag_report(struct dag *d) {
+  static const char *states[] = {"not run", "running", "", "skipped"};
+  struct dag_step *st;
+  int *order = dag_order(d);
+  int i, j, k = -1;
+
+  printf("%-16s %-8s %10s %10s\n", "STEP", "STATUS", "START(s)", "TIME(s)");
+  for (i = 0; i < d->count; ++i) {
+    st = &d->steps[i];
+    if (st->state != DAG_DONE) {
+      printf("%-16s %s\n", st->name, states[st->state]);
+      continue;
+    }
+    printf("%-16s %-8d %10.3f %10.3f\n", st->name, st->status,
+           (st->start_ns - d->start_ns) / 1e9,
+           (st->end_ns - st->start_ns) / 1e9);
+  }
+
+  // Ranks again, by measured times this time, from the last steps back
+  for (i = d->count - 1; i >= 0; --i) {
+    st = &d->steps[order[i]];
+    st->rank_ns = dag_longest(d, order[i]) +
+                  (st->state == DAG_DONE ? st->end_ns - st->start_ns : 0);
+    if (k == -1 || st->rank_ns > d->steps[k].rank_ns) {
+      k = order[i];
+    }
+  }
+  if (k == -1 || d->steps[k].rank_ns == 0) {
+    return;
+  }
+
+  // Forward from the longest, through the user on the longest path each
+  printf("critical path:");
+  for (st = &d->steps[k]; st != NULL;) {
+    struct dag_step *next = NULL;
+    for (j = 0; j < st->nusers; ++j) {
+      struct dag_step *user = &d->steps[st->users[j]];
+      if (user->rank_ns > 0 &&
+          (next == NULL || user->rank_ns > next->rank_ns)) {
+        next = user;
+      }
+    }
+    printf(" %s%s", st->name, next != NULL ? " ->" : "");
+    st = next;
   }
+  printf(" (%.3fs)\n", d->steps[k].rank_ns / 1e9);
 }
 
 /**
- * @fn series
+ * @fn builtin_dag
  * @param[in] tokens
- * @brief Splits the token into components based on "&&".
- *        Run them one after another in foreground
+ * @param[in] c
+ * @return 0 if every step ran and succeeded, 1 otherwise
+ * @brief "dag file": run the steps of the file, each once the steps it
+ *        needs have succeeded, at most max_jobs at once
  */
-void series(char **tokens) {
-  char **ptokens = (char **)malloc(MAX_NUM_TOKENS * sizeof(char *));
-  int i, j;
+int builtin_dag(char **tokens, struct chain *c) {
+  struct dag d;
+  struct stat st;
+  char *text;
+  ssize_t n;
+  size_t len = 0, size;
+  int i, fd, ret = 0;
 
-  // Split into components
-  j = 0;
-  for (i = 0; tokens[i] != NULL; ++i) {
-    if (strcmp(tokens[i], "&&")) {
-      ptokens[j] = tokens[i];
-      ++j;
-    } else {
-      // If encountered a "&&", segment till now is run and waited for
-      ptokens[j] = NULL;
-      run(ptokens);
-      j = 0;
+  if (tokens[1] == NULL || tokens[2] != NULL) {
+    printf("Shell: Incorrect command\n");
+    return 1;
+  }
+  fd = open(tokens[1], O_RDONLY | O_CLOEXEC);
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    printf("Shell: Can't open %s\n", tokens[1]);
+    if (fd != -1) {
+      close(fd);
+    }
+    return 1;
+  }
+  size = st.st_size > 0 ? (size_t)st.st_size : 0;
+  text = (char *)arena_alloc(&line_arena, size + 1);
+  while (len < size && ((n = read(fd, text + len, size - len)) > 0 ||
+                        (n == -1 && errno == EINTR))) {
+    len += n > 0 ? n : 0;
+  }
+  close(fd);
+  text[len] = '\0';
+
+  memset(&d, 0, sizeof(d));
+  if (dag_parse(text, &d) == -1) {
+    return 1;
+  }
+  if (dag_rank(&d) == -1) {
+    printf("Shell: Steps of %s depend on each other in a cycle\n", tokens[1]);
+    return 1;
+  }
+
+  if (c == NULL) {
+    // Forked shell, the parent's event loop and output went with its
+    // descriptors
+    events_init();
+    memset(&output, 0, sizeof(output));
+  }
+  d.ready = (int *)arena_alloc(&line_arena, d.count * sizeof(int));
+  for (i = 0; i < d.count; ++i) {
+    d.steps[i].dag = &d;
+    if (d.steps[i].ndeps == 0) {
+      dag_heap_push(&d, i);
     }
   }
-  // Same for last segment
-  ptokens[j] = NULL;
-  run(ptokens);
+  d.start_ns = now_ns();
+  dag_fill(&d);
+  while (d.running > 0 || (output.head != NULL && !interrupt)) {
+    wait_events(-1);
+  }
+  output_drop(&output);
 
-  // Free the allocated memory
-  free(ptokens);
+  dag_report(&d);
+  for (i = 0; i < d.count; ++i) {
+    if (d.steps[i].state != DAG_DONE || d.steps[i].status != 0) {
+      ret = 1;
+    }
+  }
+  return ret;
 }
 
 /**
- * @fn parallel
- * @param[in] tokens
- * @brief Run the command on a new shell as a foreground process
+ * @fn client_free
+ * @param[in] cl
+ * @brief Forget a client that hung up, once its line is done
  */
-void parallel(char **tokens) {
-  int i;
+void client_free(struct client *cl) {
+  int k;
 
-  // Check availability of foreground process and set i accordingly
-  for (i = 0; i < MAX_FG_PROCESS; i++) {
-    if (foreground_proc[i] == -1) {
-      break;
+  if (msgs.to == &cl->out) {
+    msgs_switch(NULL);
+  }
+  // What its stderr can't take right away is lost with it
+  output_flush(&cl->out);
+  output_drop(&cl->out);
+  for (k = 0; k < 3; ++k) {
+    if (cl->fds[k] >= 0) {
+      close(cl->fds[k]);
+    }
+    if (cl->out.fds[k] > 0) {
+      close(cl->out.fds[k]);
     }
   }
-  if (i == MAX_FG_PROCESS) {
-    printf("Shell: Can't handle more foreground processes\n");
-    return;
+  if (cl->group.kill_timer.fd != -1) {
+    event_del(&cl->group.kill_timer);
+    close(cl->group.kill_timer.fd);
   }
+  arena_reset(&cl->arena);
+  free(cl->arena.head);
+  free(cl);
+}
 
-  // Fork another shell to run the command
-  int ret = fork();
-  if (ret < 0) {
-    printf("Shell: Error while calling fork\n");
-  } else if (ret == 0) {
-    // Child process
-    series(tokens);
-    exit(0);
-  } else { // ret > 0
-    // Parent process with ret as Child PID
-    foreground_proc[i] = ret;
+void client_next(struct client *cl);
+
+/**
+ * @fn client_done
+ * @param[in] f
+ * @brief The client's line has ended: send back its status and resources
+ *        used (after the shell's messages about it), then go on with the
+ *        next line
+ */
+void client_done(struct fanout *f) {
+  struct client *cl = (struct client *)f->data;
+  struct timing *t = f->timing;
+  char reply[256];
+  int len;
+
+  line_end(&cl->group);
+  if (cl->deadline != NULL && watchdog_stop(cl->deadline)) {
+    printf("Shell: Line stopped at its deadline, ran %.3fs\n",
+           (now_ns() - t->start_ns) / 1e9);
+  }
+  cl->deadline = NULL;
+  if (msgs.to == &cl->out) {
+    msgs_switch(&cl->out);
+  }
+
+  len = snprintf(reply, sizeof(reply),
+                 "status %d real_us %ld user_us %ld sys_us %ld maxrss_kb %ld "
+                 "nvcsw %ld nivcsw %ld\n",
+                 f->status, (now_ns() - t->start_ns) / 1000, t->utime_us,
+                 t->stime_us, t->maxrss_kb, t->nvcsw, t->nivcsw);
+  if (cl->src.fd >= 0) {
+    send(cl->src.fd, reply, len, MSG_NOSIGNAL);
+  }
+  cl->busy = 0;
+  if (!cl->starting) {
+    client_next(cl);
   }
 }
 
 /**
- * @fn work
- * @param[in] tokens
- * @brief Splits the token into components based on "&&&".
- *        Run them parallelly in foreground
+ * @fn client_next
+ * @param[in] cl
+ * @brief Start the next complete line the client sent, or wait for more
  */
-void work(char **tokens) {
-  char **ptokens = (char **)malloc(MAX_NUM_TOKENS * sizeof(char *));
-  int i, j;
+void client_next(struct client *cl) {
+  char *nl, *line;
+  char **tokens;
+  size_t len;
+  struct output_queue *prev;
 
-  // Split into components
-  j = 0;
-  for (i = 0; tokens[i] != NULL; ++i) {
-    if (strcmp(tokens[i], "&&&")) {
-      ptokens[j] = tokens[i];
-      ++j;
+  while (!cl->busy) {
+    nl = (char *)memchr(cl->buf, '\n', cl->len);
+    if (nl == NULL) {
+      if (cl->hung_up) {
+        client_free(cl);
+      } else if (!cl->reading) {
+        event_add(&cl->src, EPOLLIN);
+        cl->reading = 1;
+      }
+      return;
+    }
+
+    // The line gets an arena of its own, others are still running
+    len = nl - cl->buf;
+    arena_reset(&cl->arena);
+    line = (char *)arena_alloc(&cl->arena, len + 1);
+    memcpy(line, cl->buf, len);
+    line[len] = '\0';
+    cl->len -= len + 1;
+    memmove(cl->buf, nl + 1, cl->len);
+    prev = msgs_begin(&cl->out);
+    tokens = tokenize(line, &cl->arena);
+
+    // Lines arrive one at a time, stop reading until this one is done
+    if (cl->reading) {
+      event_del(&cl->src);
+      cl->reading = 0;
+    }
+    memset(&cl->f, 0, sizeof(cl->f));
+    cl->f.arena = &cl->arena;
+    cl->f.fds = cl->fds;
+    cl->f.timing = timing_start(&cl->arena, NULL);
+    cl->f.on_done = client_done;
+    cl->f.data = cl;
+    cl->f.group = &cl->group;
+    cl->f.msgs = &cl->out;
+    cl->busy = 1;
+
+    // Its own process group and deadline, as a line of the terminal
+    line_begin(&cl->group);
+    if (deadline_ns > 0) {
+      cl->deadline = watchdog_start(NULL, &cl->group, deadline_ns);
+    }
+
+    // Lines ending right away come back here, let the loop go on
+    cl->starting = 1;
+    if (tokens[0] == NULL) {
+      client_done(&cl->f);
     } else {
-      // If encountered a "&&&", segment till now is run on a new shell
-      ptokens[j] = NULL;
-      parallel(ptokens);
-      j = 0;
+      fanout_split(&cl->f, tokens);
+      fanout_fill(&cl->f);
+      fanout_check(&cl->f);
     }
+    cl->starting = 0;
+    msgs_end(prev);
   }
-  // Last segment is run on the current shell itself
-  ptokens[j] = NULL;
-  series(ptokens);
+}
 
-  // Wait for all foreground processes to end
-  for (i = 0; i < MAX_FG_PROCESS; ++i) {
-    if (foreground_proc[i] > 0) {
-      int k = waitpid(foreground_proc[i], NULL, 0);
-      if (k == -1) {
-        printf("Shell: Error while calling waitpid\n");
-      } else if (k == foreground_proc[i]) {
-        foreground_proc[i] = -1;
-      }
+/**
+ * @fn on_client
+ * @param[in] src
+ * @param[in] events
+ * @brief Event handler of a client connection: first its stdin, stdout and
+ *        stderr (SCM_RIGHTS), then command lines
+ */
+void on_client(struct event_source *src, unsigned events) {
+  struct client *cl = (struct client *)src->data;
+  char cbuf[CMSG_SPACE(3 * sizeof(int))], byte;
+  struct iovec iov = {&byte, 1};
+  struct msghdr msg;
+  struct cmsghdr *cm;
+  ssize_t n;
+
+  if (cl->fds[0] == -1) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    n = recvmsg(src->fd, &msg, MSG_CMSG_CLOEXEC);
+    cm = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cm != NULL && cm->cmsg_level == SOL_SOCKET &&
+        cm->cmsg_type == SCM_RIGHTS &&
+        cm->cmsg_len == CMSG_LEN(3 * sizeof(int))) {
+      memcpy(cl->fds, CMSG_DATA(cm), 3 * sizeof(int));
+      return;
+    }
+    if (n == -1 && errno == EAGAIN) {
+      return;
+    }
+    // Not a client of this shell
+    event_del(src);
+    close(src->fd);
+    client_free(cl);
+    return;
+  }
+
+  n = read(src->fd, cl->buf + cl->len, sizeof(cl->buf) - cl->len);
+  if (n > 0) {
+    cl->len += n;
+  } else if (n == -1 && errno == EAGAIN) {
+    return;
+  }
+  if (n <= 0 || cl->len == sizeof(cl->buf)) {
+    // Hung up (or sent a line too long): finish what it sent
+    event_del(src);
+    close(src->fd);
+    cl->src.fd = -1;
+    cl->reading = 0;
+    cl->hung_up = 1;
+  }
+  client_next(cl);
+}
+
+/**
+ * @fn on_accept
+ * @param[in] src
+ * @param[in] events
+ * @brief Event handler of the server socket: take new clients
+ */
+void on_accept(struct event_source *src, unsigned events) {
+  struct client *cl;
+  int fd;
+
+  while ((fd = accept4(src->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) !=
+         -1) {
+    cl = (struct client *)malloc(sizeof(struct client));
+    if (cl == NULL) {
+      close(fd);
+      continue;
     }
+    memset(cl, 0, sizeof(*cl));
+    cl->fds[0] = cl->fds[1] = cl->fds[2] = -1;
+    cl->group.tty = -1;
+    cl->group.kill_timer.fd = -1;
+    cl->out.to = cl->fds;
+    cl->src.fd = fd;
+    cl->src.handler = on_client;
+    cl->src.data = cl;
+    cl->reading = 1;
+    event_add(&cl->src, EPOLLIN);
   }
+}
 
-  // Free the allocated memory
-  free(ptokens);
+/**
+ * @fn server_start
+ * @param[in] path Of the socket to listen on
+ * @return 0 on success, -1 on error (reported)
+ * @brief Take command lines from clients connecting to path, each run in
+ *        the event loop as its lines come
+ */
+int server_start(const char *path) {
+  static struct event_source listener;
+  struct sockaddr_un addr;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Shell: Socket path too long\n");
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  listener.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  unlink(path);
+  if (listener.fd == -1 ||
+      bind(listener.fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(listener.fd, SOMAXCONN) == -1) {
+    fprintf(stderr, "Shell: Can't listen on %s\n", path);
+    return -1;
+  }
+  listener.handler = on_accept;
+  event_add(&listener, EPOLLIN);
+  return 0;
 }
 
 /**
  * @fn handle_sig
  * @param[in] sig
  * @brief SIGINT handler
- *        Does nothing, just sets interrupt to 1 (no new command will run)
+ *        Sets interrupt to 1 (no new command will run), the event loop
+ *        passes it on to the line's process group
  */
 void handle_sig(int sig) {
+  int saved = errno;
   printf("\n");
   interrupt = 1;
-  // SIGINT passed to children in same process group as well
+  sigint_pending = 1;
+  write(sigchld_pipe[1], "", 1);
+  errno = saved;
 }
 
+#ifndef SHELL_NO_MAIN
 int main(int argc, char *argv[]) {
-  char line[MAX_INPUT_SIZE];
+  struct reader input;
+  char *line;
   char **tokens;
-  int i;
+  int opt, fd = STDIN_FILENO, report = 0;
+  size_t i;
+  const char *server = NULL;
+  long lines = 0, start;
+
+  // Default to one segment per online CPU
+  max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  if (max_jobs < 1) {
+    max_jobs = 1;
+  }
+
+  // Parse command line options
+  while ((opt = getopt(argc, argv, "s:j:f:tT:S:")) != -1) {
+    if (opt == 's' && set_option("spawn", optarg) == 0) {
+      continue;
+    } else if (opt == 'j' && set_option("jobs", optarg) == 0) {
+      continue;
+    } else if (opt == 'T' && set_option("trace", optarg) == 0) {
+      continue;
+    } else if (opt == 'f') {
+      fd = open(optarg, O_RDONLY | O_CLOEXEC);
+      if (fd == -1) {
+        fprintf(stderr, "Shell: Can't open %s\n", optarg);
+        return 1;
+      }
+    } else if (opt == 't') {
+      report = 1;
+    } else if (opt == 'S') {
+      server = optarg;
+    } else {
+      fprintf(stderr,
+              "Usage: %s [-s fork|posix|zygote] [-j jobs] [-f file] "
+              "[-t] [-T level] [-S socket]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  // Prompt only when commands are typed in
+  int interactive = fd == STDIN_FILENO && isatty(fd);
+  reader_init(&input, fd);
+  start = now_ns();
 
   // SIGINT handler added
   signal(SIGINT, handle_sig);
 
-  // Initialize list of background and foreground processes
-  for (i = 0; i < MAX_BG_PROCESS; ++i) {
-    background_proc[i] = -1;
+  // Each line gets the terminal while it runs (so Ctrl-C goes to its
+  // process group), the shell takes it back without being stopped
+  if (interactive && tcgetpgrp(STDIN_FILENO) == getpgrp()) {
+    signal(SIGTTOU, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    fg_group.tty = STDIN_FILENO;
+  }
+
+  // Background processes are reaped as soon as SIGCHLD comes in
+  events_init();
+
+  // Only typed lines are recorded by default
+  history_open(interactive);
+
+  // PATH is indexed for completion while waiting for the first lines
+  if (interactive) {
+    idle_step = path_index_step;
   }
-  for (i = 0; i < MAX_FG_PROCESS; ++i) {
-    foreground_proc[i] = -1;
+
+  // Serve clients until interrupted, instead of reading lines
+  if (server != NULL) {
+    if (server_start(server) == -1) {
+      return 1;
+    }
+    while (!interrupt) {
+      wait_events(-1);
+    }
+    unlink(server);
   }
 
-  while (1) {
-    // Scan the line
-    bzero(line, sizeof(line));
-    printf("$ ");
-    scanf("%[^\n]", line);
-    getchar();
+  while (server == NULL) {
+    // Scan the line, reporting finished background processes meanwhile
+    if (interactive) {
+#ifdef SHELL_TRACE
+      trace_flush();
+#endif
+      line = editor_getline("$ ");
+    } else {
+      line = reader_getline(&input);
+    }
+    if (line == NULL) {
+      break;
+    }
+    ++lines;
 
     // Reap background child processes which have ended
-    for (i = 0; i < MAX_BG_PROCESS; i++) {
-      if (background_proc[i] > 0) {
-        int k = waitpid(background_proc[i], NULL, WNOHANG);
-        if (k == -1) {
-          printf("Shell: Error while calling waitpid\n");
-        } else if (k == background_proc[i]) {
-          printf("Shell: Background process finished\n");
-          background_proc[i] = -1;
-        }
+    if (sigchld_pending) {
+      on_sigchld(&sigchld_source, EPOLLIN);
+    }
+
+    arena_reset(&line_arena);
+
+    // Run a line from history instead
+    if (line[0] == '!' && line[1] != '\0' && line[1] != ' ' &&
+        line[1] != '\t') {
+      line = history_expand(line);
+      if (line == NULL) {
+        continue;
       }
     }
+    history_add(line);
 
     // Break the line into tokens
-    line[strlen(line)] = '\n';
-    tokens = tokenize(line);
+    tokens = tokenize(line, &line_arena);
 
     if (tokens[0] == NULL) {
       // Nothing to do
     } else if (!strcmp(tokens[0], "exit")) {
       if (tokens[1] == NULL) {
-        // Kill background processes before exit
-        for (i = 0; i < MAX_BG_PROCESS; i++) {
-          if (background_proc[i] > -1) {
-            kill(background_proc[i], SIGKILL);
-            background_proc[i] = -1;
-          }
-        }
-
-        // Free the allocated memory
-        for (i = 0; tokens[i] != NULL; i++) {
-          free(tokens[i]);
-        }
-        free(tokens);
-
-        // Just exit
-        return 0;
+        break;
       } else {
         printf("Shell: exit command doesn't have any arguments\n");
       }
@@ -367,13 +7381,30 @@ int main(int argc, char *argv[]) {
       // Work on the tokens
       work(tokens);
     }
+  }
 
-    // Free the allocated memory
-    for (i = 0; tokens[i] != NULL; i++) {
-      free(tokens[i]);
+  // Kill background processes before exit
+  for (i = 0; i < procs.nbuckets; i++) {
+    struct proc *p;
+    for (p = procs.buckets[i]; p != NULL; p = p->next) {
+      if (p->background) {
+        TRACE(TRACE_PROC, "cancel", "\"pid\":%d,\"signal\":%d", p->pid,
+              SIGKILL);
+        kill(p->pid, SIGKILL);
+      }
     }
-    free(tokens);
+  }
+#ifdef SHELL_TRACE
+  trace_flush();
+#endif
+
+  if (report) {
+    double secs = (now_ns() - start) / 1e9;
+    fprintf(stderr, "Shell: %ld lines in %.3f s (%.0f lines/sec)\n", lines,
+            secs, secs > 0 ? lines / secs : 0.0);
   }
 
+  // Just exit
   return 0;
 }
+#endif